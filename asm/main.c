@@ -285,10 +285,12 @@ void parse(char* line, uint32_t** out) {
             if (opcodes[index].num_operands > 0) {
                 **out |= (uint32_t)atoi(arg1 + 1) << (32 - 6 - 4);
                 **out |= (uint32_t)atoi(arg2 + 1) << (32 - 6 - 4 - 4);
-                **out |= (int32_t)strtol(arg3 + 1, NULL, 0) << (32 - 6 - 4 - 4 - 16); 
+                **out |= ((int32_t)strtol(arg3 + 1, NULL, 0) & 0xFFFF) << (32 - 6 - 4 - 4 - 16); 
             }
         } if (parse_imm(arg1) == 0) {
-            **out |= (int32_t)strtol(arg1 + 1, NULL, 0) << (32 - 6 - 4 - 4 - 16); 
+            **out |= ((int32_t)strtol(arg1 + 1, NULL, 0) & 0xFFFF) << (32 - 6 - 4 - 4 - 16); 
+        } else if (arg2 && !arg3 && parse_reg(arg1) == 0 && parse_imm(arg2) == 0) { // Rd, #imm
+            **out |= ((int32_t)strtol(arg2 + 1, NULL, 0) & 0xFFFF) << (32 - 6 - 4 - 4 - 16);
         }
         
         **out = **out;
@@ -311,6 +313,13 @@ void parse(char* line, uint32_t** out) {
             **out |= (uint32_t)atoi(arg1 + 1) << (32 - 6 - 4);
             **out |= (uint32_t)atoi(arg2 + 1) << (32 - 6 - 4 - 4);
         }
+        if (opcodes[index].num_operands > 2) {
+            if (parse_reg(arg3) != 0) {
+                puts(error);
+                exit(1);
+            }
+            **out |= (uint32_t)atoi(arg3 + 1) << (32 - 6 - 4 - 4 - 4);
+        }
         
         break;
     case M:
@@ -339,7 +348,7 @@ void parse(char* line, uint32_t** out) {
 
             if (opcodes[index].num_operands > 0) {
                 **out |= (uint32_t)atoi(arg1 + 1) << (32 - 6 - 4);
-                **out |= (int32_t)strtol(arg2 + 1, NULL, 0) << (32 - 6 - 4 - 4 - 16); 
+                **out |= ((int32_t)strtol(arg2 + 1, NULL, 0) & 0xFFFF) << (32 - 6 - 4 - 4 - 16); 
             }
             **out |= 1;
         } else if (parse_imm(arg3) == 0) {
@@ -350,7 +359,7 @@ void parse(char* line, uint32_t** out) {
             if (opcodes[index].num_operands > 0) {
                 **out |= (uint32_t)atoi(arg1 + 1) << (32 - 6 - 4);
                 **out |= (uint32_t)atoi(arg2 + 1) << (32 - 6 - 4 - 4);
-                **out |= (int32_t)strtol(arg3 + 1, NULL, 0) << (32 - 6 - 4 - 4 - 16); 
+                **out |= ((int32_t)strtol(arg3 + 1, NULL, 0) & 0xFFFF) << (32 - 6 - 4 - 4 - 16); 
             }
             **out |= 1;
         } else {
@@ -39,6 +39,14 @@ static Opcode opcodes[64] = {
     { "CALL", M,  0x21, 1},
     { "RET",  R,  0x22, 0},
     { "IRET", R,  0x23, 0},
+    { "MFB",  I,  0x24, 3},
+    { "MTB",  I,  0x25, 3},
+    { "STM",  I,  0x26, 2},
+    { "LDM",  I,  0x27, 2},
+    { "WFI",  R,  0x28, 0},
+    { "MCPY", R,  0x29, 3},
+    { "MSET", R,  0x2A, 3},
+    { "MCMP", R,  0x2B, 3},
 };
 
 #endif
\ No newline at end of file
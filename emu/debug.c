@@ -3,6 +3,8 @@
 #include "device.h"
 #include "ram.h"
 #include "../asm/ops.h"
+#include "devices/vga.h"
+#include "devices/block.h"
 
 extern Machine* global_machine;
 
@@ -155,9 +157,8 @@ static void disasm(uint32_t instr, char *out, size_t outlen, uint32_t pc) {
             snprintf(out, outlen, "%s", entry->name);
         } else if (entry->num_operands == 1) {
             snprintf(out, outlen, "%s R%u", entry->name, rd);
-        } else if (entry->num_operands == 2) {
-            /* unlikely for pure I-type, but handle defensively */
-            snprintf(out, outlen, "%s R%u, R%u", entry->name, rd, rn);
+        } else if (entry->num_operands == 2) { /* rd, imm16 */
+            snprintf(out, outlen, "%s R%u, #%s", entry->name, rd, immbuf);
         } else { /* 3 operands: rd, rn, imm16 */
             snprintf(out, outlen, "%s R%u, R%u, #%s", entry->name, rd, rn, immbuf);
         }
@@ -277,6 +278,24 @@ void print_cpu_state(const Machine* m, const Machine* prev) {
     print_flag("O", o);
     printf("\n");
 
+    const VGA* vga = vga_device.state;
+    printf(ANSI_BOLD "VGA: " ANSI_RESET "%u cells last frame, %" PRIu64 " frames\n",
+           vga->stats.cells_drawn, vga->stats.frames);
+    const BlockCacheStats* bc = block_state ? block_cache_stats(block_state->backend) : NULL;
+    if (bc) {
+        printf(ANSI_BOLD "Block cache: " ANSI_RESET "%" PRIu64 " hits, %" PRIu64 " misses, %"
+               PRIu64 " read ahead, %" PRIu64 " written back\n",
+               bc->hits, bc->misses, bc->readahead, bc->writebacks);
+    }
+    if (m->cpu.idle_cycles || m->cpu.idle_us) {
+        printf(ANSI_BOLD "Idle: " ANSI_RESET "%" PRIu64 " cycles skipped, %" PRIu64 " us asleep in WFI\n",
+               m->cpu.idle_cycles, m->cpu.idle_us);
+    }
+    if (block_state && block_state->thread_started) {
+        printf(ANSI_BOLD "Block I/O: " ANSI_RESET "%u pending, %" PRIu64 " requests merged\n",
+               block_state->inflight, block_state->merged);
+    }
+
     /* Footer with small legend */
     printf("\n" ANSI_DIM "Changed registers are highlighted.\n" ANSI_RESET);
     fflush(stdout);
@@ -312,6 +331,7 @@ void dump_machine_state(Machine* m) {
         fprintf(cpu_file, "PC: 0x%08X\n", m->cpu.pc);
         fprintf(cpu_file, "SP: 0x%08X\n", m->cpu.sp);
         fprintf(cpu_file, "Cycle: %zu\n", m->cpu.cycle);
+        fprintf(cpu_file, "Idle: %" PRIu64 " cycles, %" PRIu64 " us\n", m->cpu.idle_cycles, m->cpu.idle_us);
         fprintf(cpu_file, "Running: %s\n", m->cpu.running ? "true" : "false");
         fprintf(cpu_file, "Mode: %s\n", m->mode == BIOS ? "BIOS" :
                                         m->mode == KERNEL ? "KERNEL" : "USER");
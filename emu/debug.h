@@ -29,15 +29,6 @@ static void tty_restore(void) {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_term);
 }
 
-/* Check if there is input waiting (non-blocking) */
-static int stdin_has_data(void) {
-    fd_set rfds;
-    struct timeval tv = {0, 0};
-    FD_ZERO(&rfds);
-    FD_SET(STDIN_FILENO, &rfds);
-    return select(STDIN_FILENO + 1, &rfds, NULL, NULL, &tv) > 0;
-}
-
 #define ANSI_RESET   "\x1b[0m"
 #define ANSI_BOLD    "\x1b[1m"
 #define ANSI_DIM     "\x1b[2m"
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "device.h"
 #include "ram.h"
 
@@ -14,6 +15,8 @@ uint32_t bus_read(uint32_t addr) {
     for (size_t i = 0; i < mgr.num; i++) {
         Device* curr = mgr.devices[i];
         if (addr >= curr->base && addr <= curr->base + curr->size) {
+            if (curr->mem)
+                return curr->mem[addr - curr->base];
             if (curr->read) 
                 return curr->read(curr, addr - curr->base);
         }
@@ -25,6 +28,10 @@ void bus_write(uint32_t addr, uint32_t value) {
     for (size_t i = 0; i < mgr.num; i++) {
         Device* curr = mgr.devices[i];
         if (addr >= curr->base && addr <= curr->base + curr->size) {
+            if (curr->mem) {
+                curr->mem[addr - curr->base] = value;
+                return;
+            }
             if (curr->write) {
                 curr->write(curr, addr - curr->base, value);
                 return;
@@ -34,6 +41,35 @@ void bus_write(uint32_t addr, uint32_t value) {
     ram_write(addr, value);
 }
 
+bool bus_range_is_ram(uint32_t addr, size_t n) {
+    if (n == 0) return true;
+    uint64_t last = (uint64_t)addr + n - 1;
+    for (size_t i = 0; i < mgr.num; i++) {
+        Device* curr = mgr.devices[i];
+        if (addr <= (uint64_t)curr->base + curr->size && last >= curr->base) return false;
+    }
+    return true;
+}
+
+void bus_read_block(uint32_t addr, void* dst, size_t n) {
+    if (bus_range_is_ram(addr, n)) { ram_read_block(addr, dst, n); return; }
+    uint8_t* out = dst;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v = bus_read(addr + i);
+        memcpy(out + i * sizeof(v), &v, sizeof(v));
+    }
+}
+
+void bus_write_block(uint32_t addr, const void* src, size_t n) {
+    if (bus_range_is_ram(addr, n)) { ram_write_block(addr, src, n); return; }
+    const uint8_t* in = src;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v;
+        memcpy(&v, in + i * sizeof(v), sizeof(v));
+        bus_write(addr + i, v);
+    }
+}
+
 void bus_register(Device* dev) {
     if (mgr.num == MAX_DEVICES) return;
     mgr.devices[mgr.num++] = dev;
@@ -2,6 +2,7 @@
 #define BUS_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include "machine.h"
 
 typedef struct Device {
@@ -11,10 +12,62 @@ typedef struct Device {
     uint32_t base;
     size_t size;
     void* state;
+    /* Backing words for direct-mapped devices: when set the bus reads and
+       writes mem[addr - base] itself and never calls read/write. */
+    uint32_t* mem;
 } Device;
 
 uint32_t bus_read(uint32_t addr);
 void bus_write(uint32_t addr, uint32_t value);
 void bus_register(Device* dev);
 
+/* True when no device claims any of the n words from addr, so the whole
+   range can be accessed as plain RAM */
+bool bus_range_is_ram(uint32_t addr, size_t n);
+
+/* n words from addr to or from a host buffer: plain RAM a page at a time,
+   anything a device claims through the bus word by word */
+void bus_read_block(uint32_t addr, void* dst, size_t n);
+void bus_write_block(uint32_t addr, const void* src, size_t n);
+
+/* Interrupt lines pending at the PIC (devices/pic.h), one bit per line;
+   any thread may set them, step() takes them on the CPU thread. */
+extern _Atomic uint32_t irq_pending;
+/* Edge raises that found their line still pending */
+extern _Atomic uint32_t irq_lost;
+/* Set while the CPU thread is parked in WFI; irq_wake gets it going again */
+extern _Atomic bool irq_sleeping;
+
+void irq_wake(void);
+
+/* The SIGINT or SIGTERM that asked the emulator to stop, 0 until one
+   arrives. The step loop ends on it. */
+extern _Atomic int stop_signal;
+/* Set when main() needs the CPU thread back between instructions (a stop
+   signal, the DEBUG UI changing mode): WFI returns early for it. */
+extern _Atomic bool cpu_kick;
+
+static inline void irq_kick(void) {
+    atomic_store(&cpu_kick, true);
+    irq_wake();
+}
+
+/* Edge-triggered: the line stays pending until the CPU takes it */
+static inline void irq_raise(uint8_t line) {
+    uint32_t bit = 1u << line;
+    if (atomic_fetch_or(&irq_pending, bit) & bit)
+        atomic_fetch_add_explicit(&irq_lost, 1, memory_order_relaxed);
+    if (atomic_load(&irq_sleeping)) irq_wake();
+}
+
+/* Level-triggered: the line is pending for as long as it is held high */
+static inline void irq_set_level(uint8_t line, bool high) {
+    if (high) {
+        atomic_fetch_or(&irq_pending, 1u << line);
+        if (atomic_load(&irq_sleeping)) irq_wake();
+    } else {
+        atomic_fetch_and_explicit(&irq_pending, ~(1u << line), memory_order_release);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -6,103 +6,371 @@
 #include "../device.h"
 #include "block.h"
 
-static int seek_sector(FILE* f, uint32_t sector) {
-    if (!f) return -1;
-    off_t off = (off_t)sector * SECTOR_SIZE;
-    if (fseeko(f, off, SEEK_SET) != 0) return -1;
-    return 0;
+BlockConfig block_config = {
+    .path = "orion.img",
+    .mmap = true,
+    .cache_sectors = 256,
+};
+
+static inline size_t block_bytes(BlockState* b) {
+    return (size_t)(b->count ? b->count : 1) * SECTOR_SIZE;
+}
+
+/* A transfer through the data ports has reached the end of the buffer */
+static void block_transfer_done(BlockState* b) {
+    if (b->status == BLK_STATUS_READY && b->buf_pos >= b->buf_len) {
+        b->status = BLK_STATUS_IDLE;
+        b->buf_pos = 0;
+    }
+}
+
+static inline uint64_t block_offset(BlockState* b) {
+    return (uint64_t)b->sector_index * SECTOR_SIZE;
+}
+
+/* A mapped image is read in place: the data ports (and DMA) copy straight
+   out of it. A later write cannot move the mapping under a pending read,
+   since entering write mode abandons the read. */
+static void block_cmd_read(BlockState* b) {
+    BlockBackend* be = b->backend;
+    size_t len = block_bytes(b);
+    uint8_t* p = be->ops->map ? be->ops->map(be, block_offset(b), len) : NULL;
+    if (p) {
+        b->data = p;
+    } else if (be->ops->read(be, block_offset(b), b->buffer, len) == 0) {
+        b->data = b->buffer;
+    } else {
+        b->status = BLK_STATUS_ERROR;
+        b->dirty = 0;
+        return;
+    }
+    b->status = BLK_STATUS_READY;
+    b->buf_pos = 0;
+    b->buf_len = len;
+    b->dirty = 0;
+}
+
+/* Writes the length latched by BLK_REG_WRITE: COUNT may have changed
+   since, and the buffer past what the guest filled is stale */
+static void block_cmd_write(BlockState* b) {
+    BlockBackend* be = b->backend;
+    if (be->ops->write(be, block_offset(b), b->buffer, b->buf_len) != 0) {
+        b->status = BLK_STATUS_ERROR;
+    } else {
+        b->status = BLK_STATUS_IDLE;
+        b->dirty = 0;
+        b->buf_pos = 0;
+    }
+}
+
+/* Async I/O */
+
+/* The run of requests from r that can share one backend call: the same
+   command on consecutive sectors, or back-to-back flushes */
+static BlockRequest* block_merge_run(BlockRequest* r, uint32_t* sectors) {
+    BlockRequest* last = r;
+    *sectors = r->count;
+    while (last->next && last->next->cmd == r->cmd) {
+        BlockRequest* n = last->next;
+        if (r->cmd != BLK_CMD_FLUSH) {
+            if (n->sector != last->sector + last->count) break;
+            if (*sectors + n->count > BLK_MERGE_SECTORS) break;
+        }
+        *sectors += n->count;
+        last = n;
+    }
+    return last;
+}
+
+static void block_io_run(BlockState* b, BlockRequest* first, BlockRequest* last, uint32_t sectors, uint8_t* stage) {
+    BlockBackend* be = b->backend;
+    uint64_t off = (uint64_t)first->sector * SECTOR_SIZE;
+    int rc = 0;
+    if (first->cmd == BLK_CMD_FLUSH) {
+        rc = be->ops->flush(be);
+    } else if (first == last) {
+        rc = first->cmd == BLK_CMD_READ ? be->ops->read(be, off, first->data, (size_t)sectors * SECTOR_SIZE)
+                                        : be->ops->write(be, off, first->data, (size_t)sectors * SECTOR_SIZE);
+    } else if (first->cmd == BLK_CMD_READ) {
+        rc = be->ops->read(be, off, stage, (size_t)sectors * SECTOR_SIZE);
+        size_t pos = 0;
+        for (BlockRequest* r = first; rc == 0; r = r->next) {
+            memcpy(r->data, stage + pos, (size_t)r->count * SECTOR_SIZE);
+            pos += (size_t)r->count * SECTOR_SIZE;
+            if (r == last) break;
+        }
+    } else {
+        size_t pos = 0;
+        for (BlockRequest* r = first;; r = r->next) {
+            memcpy(stage + pos, r->data, (size_t)r->count * SECTOR_SIZE);
+            pos += (size_t)r->count * SECTOR_SIZE;
+            if (r == last) break;
+        }
+        rc = be->ops->write(be, off, stage, pos);
+    }
+    for (BlockRequest* r = first;; r = r->next) {
+        r->result = rc;
+        if (r == last) break;
+    }
+}
+
+static void* block_io_loop(void* arg) {
+    BlockState* b = arg;
+    uint8_t* stage = malloc((size_t)BLK_MERGE_SECTORS * SECTOR_SIZE);
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (!b->queue && !b->stop) pthread_cond_wait(&b->wake, &b->lock);
+        if (!b->queue) break;
+        /* Take everything queued so far; it is merged as one batch */
+        BlockRequest* batch = b->queue;
+        BlockRequest* tail = b->queue_tail;
+        b->queue = b->queue_tail = NULL;
+        b->working = true;
+        pthread_mutex_unlock(&b->lock);
+
+        bool irq = false;
+        for (BlockRequest* r = batch; r;) {
+            uint32_t sectors;
+            BlockRequest* last = stage ? block_merge_run(r, &sectors) : r;
+            if (!stage) sectors = r->count;
+            block_io_run(b, r, last, sectors, stage);
+            for (BlockRequest* m = r; m != last; m = m->next) b->merged++;
+            for (BlockRequest* m = r;; m = m->next) {
+                irq |= m->irq;
+                if (m == last) break;
+            }
+            r = last->next;
+        }
+
+        pthread_mutex_lock(&b->lock);
+        if (b->done_tail) b->done_tail->next = batch;
+        else b->done = batch;
+        b->done_tail = tail;
+        b->working = false;
+        atomic_store_explicit(&b->has_done, true, memory_order_release);
+        pthread_cond_broadcast(&b->idle);
+        if (irq) irq_raise(BLK_IRQ);
+    }
+    pthread_mutex_unlock(&b->lock);
+    free(stage);
+    return NULL;
+}
+
+/* Put the oldest completed read in the buffer for the data ports */
+static void block_next_result(BlockState* b) {
+    BlockRequest* r = b->results;
+    b->results = r->next;
+    if (!b->results) b->results_tail = NULL;
+    memcpy(b->buffer, r->data, (size_t)r->count * SECTOR_SIZE);
+    b->data = b->buffer;
+    b->status = BLK_STATUS_READY;
+    b->buf_pos = 0;
+    b->buf_len = (size_t)r->count * SECTOR_SIZE;
+    free(r->data);
+    free(r);
+}
+
+/* Completed reads the guest has not read out yet are dropped when a
+   command run in the STR takes over the buffer */
+static void block_drop_results(BlockState* b) {
+    while (b->results) {
+        BlockRequest* r = b->results;
+        b->results = r->next;
+        free(r->data);
+        free(r);
+    }
+    b->results_tail = NULL;
+}
+
+/* Apply finished requests to the device state, on the CPU thread. Each
+   read keeps its own data until the guest gets to it: results are served
+   oldest first, the next one as soon as the data ports are idle again. */
+static void block_reap(BlockState* b) {
+    if (atomic_load_explicit(&b->has_done, memory_order_acquire)) {
+        pthread_mutex_lock(&b->lock);
+        BlockRequest* r = b->done;
+        b->done = b->done_tail = NULL;
+        atomic_store_explicit(&b->has_done, false, memory_order_relaxed);
+        pthread_mutex_unlock(&b->lock);
+        while (r) {
+            BlockRequest* next = r->next;
+            b->inflight--;
+            if (r->result == 0 && r->cmd == BLK_CMD_READ) {
+                r->next = NULL;
+                if (b->results_tail) b->results_tail->next = r;
+                else b->results = r;
+                b->results_tail = r;
+            } else {
+                if (r->result != 0) b->status = BLK_STATUS_ERROR;
+                free(r->data);
+                free(r);
+            }
+            r = next;
+        }
+    }
+    if (b->results && b->status == BLK_STATUS_IDLE) block_next_result(b);
+}
+
+/* Wait for the I/O thread to finish everything queued, so the CPU thread
+   can use the backend itself */
+static void block_drain(BlockState* b) {
+    if (!b->inflight) return;
+    pthread_mutex_lock(&b->lock);
+    while (b->queue || b->working) pthread_cond_wait(&b->idle, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    block_reap(b);
+}
+
+static void block_submit(BlockState* b, uint8_t cmd) {
+    if (!b->thread_started) {
+        if (pthread_create(&b->thread, NULL, block_io_loop, b) != 0) {
+            b->status = BLK_STATUS_ERROR;
+            return;
+        }
+        b->thread_started = true;
+    }
+    BlockRequest* r = calloc(1, sizeof(BlockRequest));
+    if (!r) { b->status = BLK_STATUS_ERROR; return; }
+    r->cmd = cmd;
+    r->sector = b->sector_index;
+    if (cmd == BLK_CMD_WRITE) r->count = (uint32_t)(b->buf_len / SECTOR_SIZE);
+    else if (cmd == BLK_CMD_READ) r->count = (uint32_t)(block_bytes(b) / SECTOR_SIZE);
+    r->irq = b->ctrl & BLK_CTRL_IRQ;
+    if (r->count) {
+        r->data = malloc((size_t)r->count * SECTOR_SIZE);
+        if (!r->data) { free(r); b->status = BLK_STATUS_ERROR; return; }
+    }
+    if (cmd == BLK_CMD_WRITE) {
+        /* The guest may fill the buffer for the next write straight away */
+        memcpy(r->data, b->buffer, (size_t)r->count * SECTOR_SIZE);
+        b->status = BLK_STATUS_IDLE;
+        b->dirty = 0;
+        b->buf_pos = 0;
+    } else if (cmd == BLK_CMD_READ && b->status != BLK_STATUS_READY) {
+        /* A result still being read out stays; this one queues behind it */
+        b->status = BLK_STATUS_IDLE;
+    }
+    b->inflight++;
+    pthread_mutex_lock(&b->lock);
+    if (b->queue_tail) b->queue_tail->next = r;
+    else b->queue = r;
+    b->queue_tail = r;
+    pthread_cond_signal(&b->wake);
+    pthread_mutex_unlock(&b->lock);
 }
 
 uint32_t block_read(Device* self, uint32_t addr_word) {
     BlockState* b = (BlockState*)self->state;
+    block_reap(b);
     switch (addr_word) {
-        case 0: {
-            if (b->status != 1) return 0;
-            uint8_t v = b->buffer[b->buf_pos];
-            b->buf_pos++;
-            if (b->buf_pos >= SECTOR_SIZE) {
-                b->status = 0;
-                b->buf_pos = 0;
-            }
+        case BLK_REG_DATA: {
+            if (b->status != BLK_STATUS_READY) return 0;
+            uint8_t v = b->data[b->buf_pos++];
+            block_transfer_done(b);
             return (uint32_t)v;
         }
-        case 1: return (uint32_t)b->status;
-        case 3: return (uint32_t)(b->sector_index & 0xFF);
-        case 4: return (uint32_t)((b->sector_index >> 8) & 0xFF);
-        case 5: return (uint32_t)((b->sector_index >> 16) & 0xFF);
+        case BLK_REG_DATA32: {
+            if (b->status != BLK_STATUS_READY) return 0;
+            uint32_t v = 0;
+            for (int i = 0; i < 4 && b->buf_pos < b->buf_len; i++) {
+                v |= (uint32_t)b->data[b->buf_pos++] << (8 * i);
+            }
+            block_transfer_done(b);
+            return v;
+        }
+        case BLK_REG_STATUS: return b->inflight ? BLK_STATUS_BUSY : (uint32_t)b->status;
+        case BLK_REG_SECTOR0: return (uint32_t)(b->sector_index & 0xFF);
+        case BLK_REG_SECTOR1: return (uint32_t)((b->sector_index >> 8) & 0xFF);
+        case BLK_REG_SECTOR2: return (uint32_t)((b->sector_index >> 16) & 0xFF);
+        case BLK_REG_COUNT: return b->count;
+        case BLK_REG_FLAGS: {
+            uint32_t flags = b->inflight ? BLK_FLAG_BUSY : 0;
+            if (b->status == BLK_STATUS_READY || b->status == BLK_STATUS_WRITE) flags |= BLK_FLAG_DRQ;
+            if (b->status == BLK_STATUS_ERROR) flags |= BLK_FLAG_ERR;
+            return flags;
+        }
+        case BLK_REG_SECTOR: return b->sector_index;
+        case BLK_REG_CACHE_HITS:
+        case BLK_REG_CACHE_MISSES:
+        case BLK_REG_READAHEAD: {
+            const BlockCacheStats* st = block_cache_stats(b->backend);
+            if (!st) return 0;
+            if (addr_word == BLK_REG_CACHE_HITS) return (uint32_t)st->hits;
+            if (addr_word == BLK_REG_CACHE_MISSES) return (uint32_t)st->misses;
+            return (uint32_t)st->readahead;
+        }
+        case BLK_REG_CTRL: return b->ctrl;
+        case BLK_REG_PENDING: return b->inflight;
         default: return 0;
     }
 }
 
 void block_write(Device* self, uint32_t addr_word, uint32_t value) {
     BlockState* b = (BlockState*)self->state;
+    block_reap(b);
     switch (addr_word) {
-        case 0: {
-            if (b->status != 2) return;
-            if (b->buf_pos >= SECTOR_SIZE) return;
+        case BLK_REG_DATA: {
+            if (b->status != BLK_STATUS_WRITE) return;
+            if (b->buf_pos >= b->buf_len) return;
             b->buffer[b->buf_pos++] = (uint8_t)(value & 0xFF);
             b->dirty = 1;
             break;
         }
-        case 2: {
+        case BLK_REG_DATA32: {
+            if (b->status != BLK_STATUS_WRITE) return;
+            for (int i = 0; i < 4 && b->buf_pos < b->buf_len; i++) {
+                b->buffer[b->buf_pos++] = (uint8_t)(value >> (8 * i));
+            }
+            b->dirty = 1;
+            break;
+        }
+        case BLK_REG_CMD: {
             uint32_t cmd = value & 0xFF;
-            if (cmd == 1) {
+            if ((b->ctrl & BLK_CTRL_ASYNC) && cmd >= BLK_CMD_READ && cmd <= BLK_CMD_FLUSH) {
+                block_submit(b, (uint8_t)cmd);
+                break;
+            }
+            block_drain(b);
+            block_drop_results(b);
+            if (cmd == BLK_CMD_RESET) {
                 b->buf_pos = 0;
-                b->status = 0;
+                b->status = BLK_STATUS_IDLE;
                 b->dirty = 0;
-                memset(b->buffer, 0, SECTOR_SIZE);
-            } else if (cmd == 2) {
-                if (!b->file || seek_sector(b->file, b->sector_index) != 0) {
-                    b->status = 3;
-                } else {
-                    size_t n = fread(b->buffer, 1, SECTOR_SIZE, b->file);
-                    if (n < SECTOR_SIZE) {
-                        if (feof(b->file)) {
-                            memset(b->buffer + n, 0, SECTOR_SIZE - n);
-                            b->status = 1;
-                            b->buf_pos = 0;
-                        } else {
-                            b->status = 3;
-                        }
-                    } else {
-                        b->status = 1;
-                        b->buf_pos = 0;
-                    }
-                }
-                b->dirty = 0;
-            } else if (cmd == 3) {
-                if (!b->file || seek_sector(b->file, b->sector_index) != 0) {
-                    b->status = 3;
-                } else {
-                    size_t w = fwrite(b->buffer, 1, SECTOR_SIZE, b->file);
-                    if (w != SECTOR_SIZE) {
-                        b->status = 3;
-                    } else {
-                        fflush(b->file);
-                        b->status = 0;
-                        b->dirty = 0;
-                        b->buf_pos = 0;
-                    }
-                }
-            } else if (cmd == 4) {
-                if (!b->file || fflush(b->file) != 0) b->status = 3;
+                memset(b->buffer, 0, block_bytes(b));
+                b->data = b->buffer;
+            } else if (cmd == BLK_CMD_READ) {
+                block_cmd_read(b);
+            } else if (cmd == BLK_CMD_WRITE) {
+                block_cmd_write(b);
+            } else if (cmd == BLK_CMD_FLUSH) {
+                if (b->backend->ops->flush(b->backend) != 0) b->status = BLK_STATUS_ERROR;
             }
             break;
         }
-        case 3:
+        case BLK_REG_SECTOR0:
             b->sector_index = (b->sector_index & 0xFFFF00) | (value & 0xFF);
             break;
-        case 4:
+        case BLK_REG_SECTOR1:
             b->sector_index = (b->sector_index & 0xFF00FF) | ((value & 0xFF) << 8);
             break;
-        case 5:
+        case BLK_REG_SECTOR2:
             b->sector_index = (b->sector_index & 0x00FFFF) | ((value & 0xFF) << 16);
             break;
-        case 6:
-            b->status = 2;
+        case BLK_REG_WRITE:
+            b->status = BLK_STATUS_WRITE;
             b->buf_pos = 0;
+            b->buf_len = block_bytes(b);
             b->dirty = 0;
             break;
+        case BLK_REG_COUNT:
+            b->count = value > BLK_MAX_SECTORS ? BLK_MAX_SECTORS : value;
+            break;
+        case BLK_REG_SECTOR:
+            b->sector_index = value & 0xFFFFFF;
+            break;
+        case BLK_REG_CTRL:
+            b->ctrl = value & (BLK_CTRL_ASYNC | BLK_CTRL_IRQ);
+            break;
         default:
             break;
     }
@@ -111,29 +379,64 @@ void block_write(Device* self, uint32_t addr_word, uint32_t value) {
 BlockState* block_init(const char* path) {
     BlockState* b = (BlockState*)calloc(1, sizeof(BlockState));
     if (!b) return NULL;
-    b->file = fopen(path, "r+b");
-    if (!b->file) b->file = fopen(path, "w+b");
-    if (!b->file) { free(b); return NULL; }
+    b->backend = block_backend_open(path, block_config.mmap);
+    if (!b->backend) { free(b); return NULL; }
+    if (block_config.cache_sectors) {
+        BlockBackend* cached = block_cache_new(b->backend, block_config.cache_sectors);
+        if (cached) b->backend = cached;
+    }
+    b->data = b->buffer;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->wake, NULL);
+    pthread_cond_init(&b->idle, NULL);
     b->sector_index = 0;
+    b->count = 1;
     b->buf_pos = 0;
-    b->status = 0;
+    b->buf_len = SECTOR_SIZE;
+    b->status = BLK_STATUS_IDLE;
     b->dirty = 0;
-    memset(b->buffer, 0, SECTOR_SIZE);
+    memset(b->buffer, 0, sizeof(b->buffer));
     return b;
 }
 
 void block_close(BlockState* b) {
     if (!b) return;
-    if (b->file) { fflush(b->file); fclose(b->file); }
+    if (b->thread_started) {
+        pthread_mutex_lock(&b->lock);
+        b->stop = true;
+        pthread_cond_signal(&b->wake);
+        pthread_mutex_unlock(&b->lock);
+        pthread_join(b->thread, NULL);
+        block_reap(b);
+        block_drop_results(b);
+    }
+    b->backend->ops->close(b->backend);
     free(b);
 }
 
+uint8_t* block_dma_span(BlockState* b, bool to_device, size_t* len) {
+    if (b) block_reap(b);
+    uint8_t want = to_device ? BLK_STATUS_WRITE : BLK_STATUS_READY;
+    if (!b || b->status != want || b->buf_pos >= b->buf_len) {
+        *len = 0;
+        return NULL;
+    }
+    *len = b->buf_len - b->buf_pos;
+    return (to_device ? b->buffer : b->data) + b->buf_pos;
+}
+
+void block_dma_done(BlockState* b, bool to_device, size_t bytes) {
+    b->buf_pos += bytes;
+    if (to_device) b->dirty = 1;
+    else block_transfer_done(b);
+}
+
 BlockState* block_state = NULL;
 
 Device block_device = {
     .read = block_read,
     .write = block_write,
     .base = 0x00FE0000,
-    .size = 0x8,
+    .size = BLK_REG_PENDING,
     .state = NULL,
-};
\ No newline at end of file
+};
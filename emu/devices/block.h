@@ -1,21 +1,112 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include "block_backend.h"
+#include "block_cache.h"
+
 #define SECTOR_SIZE 512
+#define BLK_MAX_SECTORS 128 /* most sectors one command can move */
+#define BLK_MERGE_SECTORS 1024 /* most sectors queued requests merge into */
+
+#define BLK_IRQ 2
+
+/* Register offsets from the device base */
+#define BLK_REG_DATA    0x0 /* one byte per access */
+#define BLK_REG_STATUS  0x1 /* one of BLK_STATUS_* */
+#define BLK_REG_CMD     0x2 /* write one of BLK_CMD_* */
+#define BLK_REG_SECTOR0 0x3 /* sector index bits 7..0 */
+#define BLK_REG_SECTOR1 0x4 /* sector index bits 15..8 */
+#define BLK_REG_SECTOR2 0x5 /* sector index bits 23..16 */
+#define BLK_REG_WRITE   0x6 /* write: start filling the buffer for BLK_CMD_WRITE */
+#define BLK_REG_DATA32  0x7 /* four bytes per access, first byte lowest */
+#define BLK_REG_COUNT   0x8 /* sectors per command, 1..BLK_MAX_SECTORS (0 means 1) */
+#define BLK_REG_FLAGS   0x9 /* read: BLK_FLAG_* bits */
+#define BLK_REG_SECTOR  0xA /* whole 24-bit sector index in one access */
+#define BLK_REG_CACHE_HITS   0xB /* read: sector cache hits, low 32 bits */
+#define BLK_REG_CACHE_MISSES 0xC /* read: sector cache misses, low 32 bits */
+#define BLK_REG_READAHEAD    0xD /* read: sectors read ahead, low 32 bits */
+#define BLK_REG_CTRL    0xE /* BLK_CTRL_* bits */
+#define BLK_REG_PENDING 0xF /* read: queued commands not yet completed */
+
+#define BLK_CMD_RESET 1
+#define BLK_CMD_READ  2
+#define BLK_CMD_WRITE 3
+#define BLK_CMD_FLUSH 4
+
+#define BLK_STATUS_IDLE  0
+#define BLK_STATUS_READY 1 /* read data waiting in the buffer */
+#define BLK_STATUS_WRITE 2 /* buffer accepting data for BLK_CMD_WRITE */
+#define BLK_STATUS_ERROR 3
+#define BLK_STATUS_BUSY  4 /* queued commands still running */
+
+#define BLK_FLAG_BUSY 0x1 /* a command is in progress */
+#define BLK_FLAG_DRQ  0x2 /* the data ports can be read or written */
+#define BLK_FLAG_ERR  0x4 /* the last command failed */
+
+#define BLK_CTRL_ASYNC 0x1 /* queue commands to the I/O thread instead of running them in the STR */
+#define BLK_CTRL_IRQ   0x2 /* raise BLK_IRQ when queued commands complete */
+
+/* A command handed to the I/O thread, with its own copy of the data */
+typedef struct BlockRequest {
+    uint8_t cmd;
+    uint32_t sector, count;
+    uint8_t* data; /* count sectors; NULL for flushes */
+    int result;
+    bool irq;
+    struct BlockRequest* next;
+} BlockRequest;
 
 typedef struct {
-    FILE* file;
-    uint8_t buffer[SECTOR_SIZE];
+    BlockBackend* backend;
+    uint8_t buffer[SECTOR_SIZE * BLK_MAX_SECTORS];
+    uint8_t* data;         /* what the data ports read: buffer, or the image itself when mapped */
     uint32_t sector_index; /* 24-bit supported */
+    uint32_t count;        /* sectors per command */
     size_t buf_pos;
+    size_t buf_len;        /* bytes the current transfer covers */
     uint8_t status; /* 0 idle, 1 data ready, 2 write mode, 3 error */
     int dirty;
+    uint32_t ctrl;  /* BLK_CTRL_* */
+
+    /* Async mode: the CPU thread submits to queue, the I/O thread moves
+       finished requests to done, and the CPU thread reaps them on its next
+       register access. Only the I/O thread touches the backend while
+       anything is queued. */
+    pthread_t thread;
+    bool thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    BlockRequest *queue, *queue_tail;
+    BlockRequest *done, *done_tail;
+    BlockRequest *results, *results_tail; /* CPU thread: reaped reads not yet served */
+    bool working, stop;    /* under lock */
+    atomic_bool has_done;
+    uint32_t inflight;     /* CPU thread: submitted and not yet reaped */
+    uint64_t merged;       /* requests folded into a neighbour's I/O */
 } BlockState;
 
+/* Set from the command line before block_init */
+typedef struct {
+    const char* path;       /* raw image or overlay */
+    bool mmap;              /* map a raw image instead of going through stdio */
+    uint32_t cache_sectors; /* write-back cache size, 0 for none */
+} BlockConfig;
+
+extern BlockConfig block_config;
+
 BlockState* block_init(const char* path);
+void block_close(BlockState* b);
+
+/* The DMA controller's side of the data ports: the bytes a guest could
+   read next (or write next, when to_device), and how many of them. */
+uint8_t* block_dma_span(BlockState* b, bool to_device, size_t* len);
+/* Consume bytes of that span exactly as the data ports would */
+void block_dma_done(BlockState* b, bool to_device, size_t bytes);
 
 extern BlockState* block_state;
 
 extern Device block_device;
 
-#endif
\ No newline at end of file
+#endif
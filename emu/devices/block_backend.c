@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_backend.h"
+#include "block_overlay.h"
+#include "block_compressed.h"
+
+BlockBackend* block_backend_open(const char* path, bool mmap) {
+    char magic[8] = {0};
+    FILE* f = fopen(path, "rb");
+    if (f) {
+        if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)) memset(magic, 0, sizeof(magic));
+        fclose(f);
+    }
+    if (memcmp(magic, OVL_MAGIC, 8) == 0) return block_backend_overlay(path);
+    if (memcmp(magic, CMP_MAGIC, 8) == 0) return block_backend_compressed(path);
+
+    BlockBackend* be = mmap ? block_backend_mmap(path) : NULL;
+    /* Fall back to stdio for images that cannot be mapped, e.g. devices */
+    return be ? be : block_backend_stdio(path);
+}
+
+/* stdio */
+
+typedef struct {
+    BlockBackend base;
+    FILE* file;
+} StdioBackend;
+
+static int stdio_read(BlockBackend* be, uint64_t off, void* buf, size_t len) {
+    StdioBackend* s = (StdioBackend*)be;
+    if (fseeko(s->file, (off_t)off, SEEK_SET) != 0) return -1;
+    size_t n = fread(buf, 1, len, s->file);
+    if (n < len && !feof(s->file)) return -1;
+    memset((uint8_t*)buf + n, 0, len - n);
+    return 0;
+}
+
+static int stdio_write(BlockBackend* be, uint64_t off, const void* buf, size_t len) {
+    StdioBackend* s = (StdioBackend*)be;
+    if (fseeko(s->file, (off_t)off, SEEK_SET) != 0) return -1;
+    if (fwrite(buf, 1, len, s->file) != len) return -1;
+    if (fflush(s->file) != 0) return -1;
+    if (off + len > be->size) be->size = off + len;
+    return 0;
+}
+
+static int stdio_flush(BlockBackend* be) {
+    StdioBackend* s = (StdioBackend*)be;
+    if (fflush(s->file) != 0) return -1;
+    return fsync(fileno(s->file));
+}
+
+static void stdio_close(BlockBackend* be) {
+    StdioBackend* s = (StdioBackend*)be;
+    fclose(s->file);
+    free(s);
+}
+
+static const BlockBackendOps stdio_ops = {
+    .read = stdio_read,
+    .write = stdio_write,
+    .flush = stdio_flush,
+    .close = stdio_close,
+};
+
+BlockBackend* block_backend_stdio(const char* path) {
+    FILE* f = fopen(path, "r+b");
+    if (!f) f = fopen(path, "w+b");
+    if (!f) return NULL;
+    StdioBackend* s = calloc(1, sizeof(StdioBackend));
+    if (!s) { fclose(f); return NULL; }
+    s->base.ops = &stdio_ops;
+    s->file = f;
+    if (fseeko(f, 0, SEEK_END) == 0) s->base.size = (uint64_t)ftello(f);
+    return &s->base;
+}
+
+/* mmap */
+
+typedef struct {
+    BlockBackend base;
+    int fd;
+    uint8_t* map; /* base.size bytes, NULL while the image is empty */
+} MmapBackend;
+
+/* Extend the file and the mapping to cover size bytes */
+static int mmap_grow(MmapBackend* m, uint64_t size) {
+    if (ftruncate(m->fd, (off_t)size) != 0) return -1;
+    void* p = m->map ? mremap(m->map, m->base.size, size, MREMAP_MAYMOVE)
+                     : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (p == MAP_FAILED) return -1;
+    m->map = p;
+    m->base.size = size;
+    return 0;
+}
+
+static int mmap_read(BlockBackend* be, uint64_t off, void* buf, size_t len) {
+    MmapBackend* m = (MmapBackend*)be;
+    size_t n = 0;
+    if (off < be->size) n = be->size - off < len ? be->size - off : len;
+    if (n) memcpy(buf, m->map + off, n);
+    memset((uint8_t*)buf + n, 0, len - n);
+    return 0;
+}
+
+static int mmap_write(BlockBackend* be, uint64_t off, const void* buf, size_t len) {
+    MmapBackend* m = (MmapBackend*)be;
+    if (off + len > be->size && mmap_grow(m, off + len) != 0) return -1;
+    memcpy(m->map + off, buf, len);
+    return 0;
+}
+
+static int mmap_flush(BlockBackend* be) {
+    MmapBackend* m = (MmapBackend*)be;
+    if (!m->map) return 0;
+    return msync(m->map, be->size, MS_SYNC);
+}
+
+static void* mmap_map(BlockBackend* be, uint64_t off, size_t len) {
+    MmapBackend* m = (MmapBackend*)be;
+    if (off + len > be->size) return NULL;
+    return m->map + off;
+}
+
+static void mmap_close(BlockBackend* be) {
+    MmapBackend* m = (MmapBackend*)be;
+    if (m->map) {
+        msync(m->map, be->size, MS_SYNC);
+        munmap(m->map, be->size);
+    }
+    close(m->fd);
+    free(m);
+}
+
+static const BlockBackendOps mmap_ops = {
+    .read = mmap_read,
+    .write = mmap_write,
+    .flush = mmap_flush,
+    .map = mmap_map,
+    .close = mmap_close,
+};
+
+BlockBackend* block_backend_mmap(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { close(fd); return NULL; }
+    MmapBackend* m = calloc(1, sizeof(MmapBackend));
+    if (!m) { close(fd); return NULL; }
+    m->base.ops = &mmap_ops;
+    m->fd = fd;
+    if (st.st_size > 0) {
+        m->map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m->map == MAP_FAILED) { close(fd); free(m); return NULL; }
+        m->base.size = (uint64_t)st.st_size;
+    }
+    return &m->base;
+}
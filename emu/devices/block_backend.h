@@ -0,0 +1,40 @@
+#ifndef DEVICES_BLOCK_BACKEND_H
+#define DEVICES_BLOCK_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Where a block device's bytes live. Offsets are in bytes; reads past the
+   end of the image see zeros and writes past the end grow it. The read,
+   write and flush calls return 0 on success and -1 on failure. */
+typedef struct BlockBackend BlockBackend;
+
+typedef struct {
+    int (*read)(BlockBackend* be, uint64_t off, void* buf, size_t len);
+    int (*write)(BlockBackend* be, uint64_t off, const void* buf, size_t len);
+    int (*flush)(BlockBackend* be);
+    /* Optional: the image's own bytes at off, valid until the next write,
+       or NULL when the range is not directly addressable. Read-only. */
+    void* (*map)(BlockBackend* be, uint64_t off, size_t len);
+    void (*close)(BlockBackend* be); /* flushes, then frees be */
+} BlockBackendOps;
+
+/* Implementations embed this as their first member */
+struct BlockBackend {
+    const BlockBackendOps* ops;
+    uint64_t size; /* image length in bytes */
+};
+
+/* Open path with the backend its format calls for: an overlay or a
+   compressed image when it starts with OVL_MAGIC or CMP_MAGIC, otherwise
+   a raw image (mapped when mmap is set
+   and the file can be mapped) */
+BlockBackend* block_backend_open(const char* path, bool mmap);
+
+/* fseeko/fread/fwrite through stdio */
+BlockBackend* block_backend_stdio(const char* path);
+/* The whole image mmap'd; msync only on flush and close */
+BlockBackend* block_backend_mmap(const char* path);
+
+#endif
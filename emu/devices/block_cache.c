@@ -0,0 +1,305 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+
+#define NONE UINT32_MAX
+
+typedef struct {
+    uint64_t sector;
+    uint32_t prev, next; /* LRU list, most recent at head */
+    uint32_t hnext;      /* hash chain */
+    bool valid, dirty;
+} CacheLine;
+
+typedef struct {
+    BlockBackend base;
+    BlockBackend* lower;
+    CacheLine* lines;
+    uint8_t* data;       /* sectors * BLK_CACHE_SECTOR, line i at i * BLK_CACHE_SECTOR */
+    uint32_t* buckets;
+    uint32_t sectors, hmask;
+    uint32_t head, tail;
+    uint64_t next_seq;   /* sector just past the last read */
+    uint32_t ra_window;  /* 0 until reads turn sequential */
+    uint8_t stage[BLK_WRITEBACK_BATCH * BLK_CACHE_SECTOR]; /* writeback batches */
+    uint8_t fetch[BLK_WRITEBACK_BATCH * BLK_CACHE_SECTOR]; /* fills; claims may write back meanwhile */
+    BlockCacheStats stats;
+} BlockCache;
+
+static inline uint8_t* line_data(BlockCache* c, uint32_t i) {
+    return c->data + (size_t)i * BLK_CACHE_SECTOR;
+}
+
+static inline uint32_t hash_sector(BlockCache* c, uint64_t sector) {
+    return (uint32_t)(sector * 0x9E3779B97F4A7C15ull >> 32) & c->hmask;
+}
+
+static uint32_t lookup(BlockCache* c, uint64_t sector) {
+    for (uint32_t i = c->buckets[hash_sector(c, sector)]; i != NONE; i = c->lines[i].hnext) {
+        if (c->lines[i].sector == sector) return i;
+    }
+    return NONE;
+}
+
+static void lru_unlink(BlockCache* c, uint32_t i) {
+    CacheLine* l = &c->lines[i];
+    if (l->prev != NONE) c->lines[l->prev].next = l->next; else c->head = l->next;
+    if (l->next != NONE) c->lines[l->next].prev = l->prev; else c->tail = l->prev;
+}
+
+static void lru_push_head(BlockCache* c, uint32_t i) {
+    CacheLine* l = &c->lines[i];
+    l->prev = NONE;
+    l->next = c->head;
+    if (c->head != NONE) c->lines[c->head].prev = i; else c->tail = i;
+    c->head = i;
+}
+
+static void touch(BlockCache* c, uint32_t i) {
+    if (c->head == i) return;
+    lru_unlink(c, i);
+    lru_push_head(c, i);
+}
+
+static void hash_remove(BlockCache* c, uint32_t i) {
+    uint32_t* p = &c->buckets[hash_sector(c, c->lines[i].sector)];
+    while (*p != i) p = &c->lines[*p].hnext;
+    *p = c->lines[i].hnext;
+}
+
+static int by_sector(const void* a, const void* b) {
+    uint64_t x = (*(const CacheLine* const*)a)->sector, y = (*(const CacheLine* const*)b)->sector;
+    return (x > y) - (x < y);
+}
+
+/* Write every dirty line back, coalescing consecutive sectors into one
+   lower write of up to BLK_WRITEBACK_BATCH sectors */
+static int writeback(BlockCache* c) {
+    CacheLine** dirty = malloc(c->sectors * sizeof(CacheLine*));
+    if (!dirty) return -1;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < c->sectors; i++) {
+        if (c->lines[i].valid && c->lines[i].dirty) dirty[n++] = &c->lines[i];
+    }
+    qsort(dirty, n, sizeof(CacheLine*), by_sector);
+    int rc = 0;
+    for (uint32_t i = 0; i < n;) {
+        uint32_t run = 0;
+        uint64_t first = dirty[i]->sector;
+        while (i + run < n && run < BLK_WRITEBACK_BATCH && dirty[i + run]->sector == first + run) {
+            memcpy(c->stage + (size_t)run * BLK_CACHE_SECTOR,
+                   line_data(c, (uint32_t)(dirty[i + run] - c->lines)), BLK_CACHE_SECTOR);
+            run++;
+        }
+        if (c->lower->ops->write(c->lower, first * BLK_CACHE_SECTOR, c->stage,
+                                 (size_t)run * BLK_CACHE_SECTOR) != 0) {
+            rc = -1;
+        } else {
+            for (uint32_t j = 0; j < run; j++) dirty[i + j]->dirty = false;
+            c->stats.writebacks += run;
+        }
+        i += run;
+    }
+    free(dirty);
+    return rc;
+}
+
+/* A line for sector, reusing the least recently used one. The line is
+   linked in but its data is the caller's to fill. */
+static uint32_t claim(BlockCache* c, uint64_t sector) {
+    uint32_t i = c->tail;
+    CacheLine* l = &c->lines[i];
+    if (l->valid) {
+        /* Dirty victims take every other dirty line with them */
+        if (l->dirty && writeback(c) != 0) return NONE;
+        hash_remove(c, i);
+    }
+    l->sector = sector;
+    l->valid = true;
+    l->dirty = false;
+    uint32_t b = hash_sector(c, sector);
+    l->hnext = c->buckets[b];
+    c->buckets[b] = i;
+    touch(c, i);
+    return i;
+}
+
+/* Fill count uncached sectors from first with one lower read */
+static int fill(BlockCache* c, uint64_t first, uint32_t count) {
+    while (count) {
+        uint32_t run = count < BLK_WRITEBACK_BATCH ? count : BLK_WRITEBACK_BATCH;
+        if (c->lower->ops->read(c->lower, first * BLK_CACHE_SECTOR, c->fetch,
+                                (size_t)run * BLK_CACHE_SECTOR) != 0) return -1;
+        for (uint32_t j = 0; j < run; j++) {
+            uint32_t i = claim(c, first + j);
+            if (i == NONE) return -1;
+            memcpy(line_data(c, i), c->fetch + (size_t)j * BLK_CACHE_SECTOR, BLK_CACHE_SECTOR);
+        }
+        first += run;
+        count -= run;
+    }
+    return 0;
+}
+
+static void readahead(BlockCache* c, uint64_t from) {
+    uint32_t n = 0;
+    while (n < c->ra_window && lookup(c, from + n) == NONE) n++;
+    /* Never let readahead push out more than half the cache */
+    if (n > c->sectors / 2) n = c->sectors / 2;
+    if (n && fill(c, from, n) == 0) c->stats.readahead += n;
+}
+
+static int cache_read(BlockBackend* be, uint64_t off, void* buf, size_t len) {
+    BlockCache* c = (BlockCache*)be;
+    if (off % BLK_CACHE_SECTOR || len % BLK_CACHE_SECTOR) {
+        if (writeback(c) != 0) return -1;
+        return c->lower->ops->read(c->lower, off, buf, len);
+    }
+    uint64_t first = off / BLK_CACHE_SECTOR;
+    uint32_t count = (uint32_t)(len / BLK_CACHE_SECTOR);
+    uint8_t* out = buf;
+    for (uint32_t k = 0; k < count;) {
+        uint32_t i = lookup(c, first + k);
+        if (i != NONE) {
+            c->stats.hits++;
+            touch(c, i);
+            memcpy(out + (size_t)k * BLK_CACHE_SECTOR, line_data(c, i), BLK_CACHE_SECTOR);
+            k++;
+            continue;
+        }
+        /* Fetch the whole run of missing sectors at once */
+        uint32_t run = 1;
+        while (k + run < count && lookup(c, first + k + run) == NONE) run++;
+        c->stats.misses += run;
+        if (run > c->sectors) {
+            if (c->lower->ops->read(c->lower, (first + k) * BLK_CACHE_SECTOR,
+                                    out + (size_t)k * BLK_CACHE_SECTOR,
+                                    (size_t)run * BLK_CACHE_SECTOR) != 0) return -1;
+        } else {
+            if (fill(c, first + k, run) != 0) return -1;
+            for (uint32_t j = 0; j < run; j++) {
+                memcpy(out + (size_t)(k + j) * BLK_CACHE_SECTOR,
+                       line_data(c, lookup(c, first + k + j)), BLK_CACHE_SECTOR);
+            }
+        }
+        k += run;
+    }
+    /* A read starting where the last one ended grows the readahead window */
+    if (first == c->next_seq) {
+        c->ra_window = c->ra_window ? c->ra_window * 2 : BLK_READAHEAD_MIN;
+        if (c->ra_window > BLK_READAHEAD_MAX) c->ra_window = BLK_READAHEAD_MAX;
+        readahead(c, first + count);
+    } else {
+        c->ra_window = 0;
+    }
+    c->next_seq = first + count;
+    return 0;
+}
+
+static int cache_write(BlockBackend* be, uint64_t off, const void* buf, size_t len) {
+    BlockCache* c = (BlockCache*)be;
+    if (off % BLK_CACHE_SECTOR || len % BLK_CACHE_SECTOR) {
+        /* Drop cached copies of the range, then go straight through */
+        if (writeback(c) != 0) return -1;
+        for (uint32_t i = 0; i < c->sectors; i++) {
+            CacheLine* l = &c->lines[i];
+            if (l->valid && (l->sector + 1) * BLK_CACHE_SECTOR > off && l->sector * BLK_CACHE_SECTOR < off + len) {
+                hash_remove(c, i);
+                l->valid = false;
+            }
+        }
+        if (c->lower->ops->write(c->lower, off, buf, len) != 0) return -1;
+    } else {
+        const uint8_t* in = buf;
+        for (uint64_t s = off / BLK_CACHE_SECTOR; s < (off + len) / BLK_CACHE_SECTOR; s++) {
+            uint32_t i = lookup(c, s);
+            if (i == NONE) i = claim(c, s);
+            else touch(c, i);
+            if (i == NONE) return -1;
+            memcpy(line_data(c, i), in, BLK_CACHE_SECTOR);
+            c->lines[i].dirty = true;
+            in += BLK_CACHE_SECTOR;
+        }
+    }
+    if (off + len > be->size) be->size = off + len;
+    return 0;
+}
+
+/* Lend out the lower image's own bytes when none of the range is dirty
+   here, so a mapped image keeps its zero-copy reads behind the cache.
+   Clean cached copies match the image, so only dirty lines get in the way. */
+static void* cache_map(BlockBackend* be, uint64_t off, size_t len) {
+    BlockCache* c = (BlockCache*)be;
+    if (!c->lower->ops->map) return NULL;
+    uint64_t first = off / BLK_CACHE_SECTOR;
+    uint64_t end = (off + len + BLK_CACHE_SECTOR - 1) / BLK_CACHE_SECTOR;
+    if (end - first <= c->sectors) {
+        for (uint64_t s = first; s < end; s++) {
+            uint32_t i = lookup(c, s);
+            if (i != NONE && c->lines[i].dirty) return NULL;
+        }
+    } else {
+        for (uint32_t i = 0; i < c->sectors; i++) {
+            CacheLine* l = &c->lines[i];
+            if (l->valid && l->dirty && l->sector >= first && l->sector < end) return NULL;
+        }
+    }
+    return c->lower->ops->map(c->lower, off, len);
+}
+
+static int cache_flush(BlockBackend* be) {
+    BlockCache* c = (BlockCache*)be;
+    int rc = writeback(c);
+    if (c->lower->ops->flush(c->lower) != 0) rc = -1;
+    return rc;
+}
+
+static void cache_close(BlockBackend* be) {
+    BlockCache* c = (BlockCache*)be;
+    writeback(c);
+    c->lower->ops->close(c->lower);
+    free(c->lines);
+    free(c->data);
+    free(c->buckets);
+    free(c);
+}
+
+static const BlockBackendOps cache_ops = {
+    .read = cache_read,
+    .write = cache_write,
+    .flush = cache_flush,
+    .map = cache_map,
+    .close = cache_close,
+};
+
+BlockBackend* block_cache_new(BlockBackend* lower, uint32_t sectors) {
+    if (sectors < 2) sectors = 2;
+    BlockCache* c = calloc(1, sizeof(BlockCache));
+    if (!c) return NULL;
+    uint32_t nb = 1;
+    while (nb < sectors) nb <<= 1;
+    c->lines = calloc(sectors, sizeof(CacheLine));
+    c->data = malloc((size_t)sectors * BLK_CACHE_SECTOR);
+    c->buckets = malloc(nb * sizeof(uint32_t));
+    if (!c->lines || !c->data || !c->buckets) {
+        free(c->lines); free(c->data); free(c->buckets); free(c);
+        return NULL;
+    }
+    c->base.ops = &cache_ops;
+    c->base.size = lower->size;
+    c->lower = lower;
+    c->sectors = sectors;
+    c->hmask = nb - 1;
+    c->next_seq = UINT64_MAX;
+    for (uint32_t i = 0; i < nb; i++) c->buckets[i] = NONE;
+    /* Every line starts on the LRU list, invalid, so claim can take the tail */
+    c->head = c->tail = NONE;
+    for (uint32_t i = 0; i < sectors; i++) lru_push_head(c, i);
+    return &c->base;
+}
+
+const BlockCacheStats* block_cache_stats(BlockBackend* be) {
+    return be && be->ops == &cache_ops ? &((BlockCache*)be)->stats : NULL;
+}
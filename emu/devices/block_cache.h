@@ -0,0 +1,24 @@
+#ifndef DEVICES_BLOCK_CACHE_H
+#define DEVICES_BLOCK_CACHE_H
+
+#include "block_backend.h"
+
+#define BLK_CACHE_SECTOR    512
+#define BLK_READAHEAD_MIN   4  /* sectors fetched ahead once reads look sequential */
+#define BLK_READAHEAD_MAX   64 /* the window doubles per sequential read up to this */
+#define BLK_WRITEBACK_BATCH 64 /* most sectors one write to the image carries */
+
+typedef struct {
+    uint64_t hits, misses; /* sector lookups */
+    uint64_t readahead;    /* sectors fetched ahead of a sequential reader */
+    uint64_t writebacks;   /* sectors written to the image */
+} BlockCacheStats;
+
+/* An LRU write-back cache of `sectors` sectors in front of lower, itself a
+   backend. Takes ownership of lower; returns NULL (leaving lower alone) on
+   allocation failure. */
+BlockBackend* block_cache_new(BlockBackend* lower, uint32_t sectors);
+
+const BlockCacheStats* block_cache_stats(BlockBackend* be);
+
+#endif
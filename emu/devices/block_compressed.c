@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "block_compressed.h"
+
+#define INDEX_CHUNKS (CMP_MAX_CLUSTERS * sizeof(CmpEntry) / CMP_INDEX_CHUNK)
+#define ENTRIES_PER_CHUNK (CMP_INDEX_CHUNK / sizeof(CmpEntry))
+#define NONE UINT32_MAX
+
+typedef struct {
+    uint32_t cluster; /* NONE when the slot is free */
+    bool dirty;
+    uint64_t used;    /* LRU stamp */
+    uint8_t data[CMP_CLUSTER];
+} CmpSlot;
+
+typedef struct {
+    BlockBackend base;
+    int fd;
+    CmpHeader header;
+    CmpEntry* index;
+    uint8_t index_dirty[INDEX_CHUNKS];
+    bool header_dirty;
+    CmpSlot slots[CMP_CACHE_CLUSTERS];
+    uint64_t clock;
+    uint8_t* packed; /* compressBound(CMP_CLUSTER) bytes */
+    uLong packed_cap;
+} Compressed;
+
+_Static_assert(CMP_INDEX_CHUNK % sizeof(CmpEntry) == 0, "index entries must not straddle chunks");
+
+static int pread_all(int fd, void* buf, size_t len, uint64_t off) {
+    uint8_t* p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0) return -1;
+        if (n == 0) { memset(p, 0, len); return 0; }
+        p += n; off += (uint64_t)n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void* buf, size_t len, uint64_t off) {
+    const uint8_t* p = buf;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n <= 0) return -1;
+        p += n; off += (uint64_t)n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static bool all_zero(const uint8_t* p, size_t len) {
+    for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (w) return false;
+    }
+    return true;
+}
+
+static void cmp_set_entry(Compressed* c, uint32_t cluster, CmpEntry e) {
+    c->index[cluster] = e;
+    c->index_dirty[cluster / ENTRIES_PER_CHUNK] = 1;
+}
+
+/* Deflate a slot back into the file, reusing the cluster's old space
+   when the new data fits */
+static int cmp_store(Compressed* c, CmpSlot* s) {
+    CmpEntry e = c->index[s->cluster];
+    const uint8_t* out = s->data;
+    uLong len = CMP_CLUSTER;
+    uint32_t flags = CMP_ENTRY_RAW;
+
+    if (all_zero(s->data, CMP_CLUSTER)) {
+        len = 0;
+        flags = 0;
+    } else {
+        uLongf packed = c->packed_cap;
+        if (compress2(c->packed, &packed, s->data, CMP_CLUSTER, Z_DEFAULT_COMPRESSION) == Z_OK &&
+            packed < CMP_CLUSTER) {
+            out = c->packed;
+            len = packed;
+            flags = 0;
+        }
+    }
+    if (len > e.alloc) {
+        e.offset = c->header.end;
+        e.alloc = (uint32_t)len;
+        c->header.end += len;
+        c->header_dirty = true;
+    }
+    if (len && pwrite_all(c->fd, out, len, e.offset) != 0) return -1;
+    e.length = (uint32_t)len;
+    e.flags = flags;
+    cmp_set_entry(c, s->cluster, e);
+    s->dirty = false;
+    return 0;
+}
+
+static int cmp_load(Compressed* c, CmpSlot* s, uint32_t cluster) {
+    CmpEntry e = c->index[cluster];
+    s->cluster = NONE;
+    s->used = 0;
+    if (e.length == 0) {
+        memset(s->data, 0, CMP_CLUSTER);
+    } else if (e.flags & CMP_ENTRY_RAW) {
+        if (pread_all(c->fd, s->data, CMP_CLUSTER, e.offset) != 0) return -1;
+    } else {
+        if (e.length > c->packed_cap || pread_all(c->fd, c->packed, e.length, e.offset) != 0) return -1;
+        uLongf n = CMP_CLUSTER;
+        if (uncompress(s->data, &n, c->packed, e.length) != Z_OK || n != CMP_CLUSTER) return -1;
+    }
+    s->cluster = cluster;
+    s->dirty = false;
+    return 0;
+}
+
+/* The slot holding cluster, loading it over the least recently used one.
+   With whole set, the caller overwrites the entire cluster and the old
+   contents are not read. */
+static CmpSlot* cmp_slot(Compressed* c, uint32_t cluster, bool whole) {
+    CmpSlot* victim = NULL;
+    for (int i = 0; i < CMP_CACHE_CLUSTERS; i++) {
+        CmpSlot* s = &c->slots[i];
+        if (s->cluster == cluster) { s->used = ++c->clock; return s; }
+        /* Free slots have used == 0, so they go first */
+        if (!victim || s->used < victim->used) victim = s;
+    }
+    if (victim->cluster != NONE && victim->dirty && cmp_store(c, victim) != 0) return NULL;
+    if (whole) {
+        victim->cluster = cluster;
+        victim->dirty = false;
+    } else if (cmp_load(c, victim, cluster) != 0) {
+        return NULL;
+    }
+    victim->used = ++c->clock;
+    return victim;
+}
+
+static bool cmp_in_range(uint64_t off, size_t len) {
+    return off + len <= (uint64_t)CMP_MAX_CLUSTERS * CMP_CLUSTER;
+}
+
+static int cmp_read(BlockBackend* be, uint64_t off, void* buf, size_t len) {
+    Compressed* c = (Compressed*)be;
+    if (!cmp_in_range(off, len)) return -1;
+    uint8_t* out = buf;
+    while (len) {
+        uint32_t cluster = (uint32_t)(off / CMP_CLUSTER);
+        size_t at = off % CMP_CLUSTER;
+        size_t n = CMP_CLUSTER - at < len ? CMP_CLUSTER - at : len;
+        CmpSlot* s = cmp_slot(c, cluster, false);
+        if (!s) return -1;
+        memcpy(out, s->data + at, n);
+        off += n; out += n; len -= n;
+    }
+    return 0;
+}
+
+static int cmp_write(BlockBackend* be, uint64_t off, const void* buf, size_t len) {
+    Compressed* c = (Compressed*)be;
+    if (!cmp_in_range(off, len)) return -1;
+    const uint8_t* in = buf;
+    uint64_t end = off + len;
+    while (len) {
+        uint32_t cluster = (uint32_t)(off / CMP_CLUSTER);
+        size_t at = off % CMP_CLUSTER;
+        size_t n = CMP_CLUSTER - at < len ? CMP_CLUSTER - at : len;
+        CmpSlot* s = cmp_slot(c, cluster, at == 0 && n == CMP_CLUSTER);
+        if (!s) return -1;
+        memcpy(s->data + at, in, n);
+        s->dirty = true;
+        off += n; in += n; len -= n;
+    }
+    if (end > be->size) {
+        be->size = c->header.size = end;
+        c->header_dirty = true;
+    }
+    return 0;
+}
+
+static int cmp_sync(Compressed* c) {
+    int rc = 0;
+    for (int i = 0; i < CMP_CACHE_CLUSTERS; i++) {
+        CmpSlot* s = &c->slots[i];
+        if (s->cluster != NONE && s->dirty && cmp_store(c, s) != 0) rc = -1;
+    }
+    for (size_t k = 0; k < INDEX_CHUNKS; k++) {
+        if (!c->index_dirty[k]) continue;
+        if (pwrite_all(c->fd, (uint8_t*)c->index + k * CMP_INDEX_CHUNK, CMP_INDEX_CHUNK,
+                       CMP_INDEX_OFFSET + k * CMP_INDEX_CHUNK) != 0) rc = -1;
+        else c->index_dirty[k] = 0;
+    }
+    if (c->header_dirty) {
+        if (pwrite_all(c->fd, &c->header, sizeof(c->header), 0) != 0) rc = -1;
+        else c->header_dirty = false;
+    }
+    return rc;
+}
+
+static int cmp_flush(BlockBackend* be) {
+    Compressed* c = (Compressed*)be;
+    if (cmp_sync(c) != 0) return -1;
+    return fsync(c->fd);
+}
+
+static void cmp_free(Compressed* c) {
+    if (c->fd >= 0) close(c->fd);
+    free(c->index);
+    free(c->packed);
+    free(c);
+}
+
+static void cmp_close(BlockBackend* be) {
+    Compressed* c = (Compressed*)be;
+    cmp_sync(c);
+    cmp_free(c);
+}
+
+static const BlockBackendOps compressed_ops = {
+    .read = cmp_read,
+    .write = cmp_write,
+    .flush = cmp_flush,
+    .close = cmp_close,
+};
+
+BlockBackend* block_backend_compressed(const char* path) {
+    Compressed* c = calloc(1, sizeof(Compressed));
+    if (!c) return NULL;
+    c->fd = open(path, O_RDWR);
+    c->index = malloc((size_t)CMP_MAX_CLUSTERS * sizeof(CmpEntry));
+    c->packed_cap = compressBound(CMP_CLUSTER);
+    c->packed = malloc(c->packed_cap);
+    if (c->fd < 0 || !c->index || !c->packed ||
+        pread_all(c->fd, &c->header, sizeof(c->header), 0) != 0 ||
+        memcmp(c->header.magic, CMP_MAGIC, 8) != 0 || c->header.version != CMP_VERSION ||
+        c->header.cluster_size != CMP_CLUSTER ||
+        pread_all(c->fd, c->index, (size_t)CMP_MAX_CLUSTERS * sizeof(CmpEntry), CMP_INDEX_OFFSET) != 0) {
+        cmp_free(c);
+        return NULL;
+    }
+    for (int i = 0; i < CMP_CACHE_CLUSTERS; i++) c->slots[i].cluster = NONE;
+    c->base.ops = &compressed_ops;
+    c->base.size = c->header.size;
+    return &c->base;
+}
+
+int block_compressed_create(const char* path) {
+    CmpHeader h = {0};
+    memcpy(h.magic, CMP_MAGIC, 8);
+    h.version = CMP_VERSION;
+    h.cluster_size = CMP_CLUSTER;
+    h.end = CMP_DATA_OFFSET;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return -1;
+    /* The index is left as a hole: every cluster starts out all zeros */
+    int rc = pwrite_all(fd, &h, sizeof(h), 0);
+    if (rc == 0) rc = ftruncate(fd, (off_t)CMP_DATA_OFFSET);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,46 @@
+#ifndef DEVICES_BLOCK_COMPRESSED_H
+#define DEVICES_BLOCK_COMPRESSED_H
+
+#include <stdint.h>
+#include "block_backend.h"
+
+/* Compressed image: the guest's bytes in clusters of CMP_CLUSTER bytes,
+   each deflated on its own. A 4 KiB header is followed by an index with a
+   slot for every possible cluster, then the cluster data. Index slots of
+   clusters never written are holes, and so are all-zero clusters, which
+   store no data at all. */
+
+#define CMP_MAGIC        "ORIONCMP"
+#define CMP_VERSION      1
+#define CMP_CLUSTER      (64 * 1024)
+#define CMP_HEADER_SIZE  4096
+#define CMP_MAX_CLUSTERS ((uint32_t)(((uint64_t)1 << 24) * 512 / CMP_CLUSTER)) /* 24-bit sector index */
+#define CMP_INDEX_OFFSET CMP_HEADER_SIZE
+#define CMP_INDEX_CHUNK  4096 /* the index is written back in chunks this size */
+#define CMP_DATA_OFFSET  ((uint64_t)CMP_INDEX_OFFSET + (uint64_t)CMP_MAX_CLUSTERS * sizeof(CmpEntry))
+#define CMP_CACHE_CLUSTERS 16 /* decompressed clusters kept in memory */
+
+#define CMP_ENTRY_RAW 0x1 /* stored uncompressed: deflate did not make it smaller */
+
+typedef struct {
+    uint64_t offset; /* of the cluster's data in the file */
+    uint32_t length; /* stored bytes, 0 for an all-zero cluster */
+    uint32_t alloc;  /* bytes reserved at offset; a rewrite that fits reuses them */
+    uint32_t flags;  /* CMP_ENTRY_* */
+    uint32_t reserved[3];
+} CmpEntry;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t size; /* image size in bytes as the guest sees it */
+    uint64_t end;  /* where the next appended cluster goes */
+} CmpHeader;
+
+/* New empty compressed image; fails if path exists */
+int block_compressed_create(const char* path);
+
+BlockBackend* block_backend_compressed(const char* path);
+
+#endif
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_overlay.h"
+#include "block_compressed.h"
+
+typedef struct {
+    BlockBackend base;
+    int fd;       /* the overlay */
+    int base_fd;  /* the base image, read-only */
+    uint64_t base_size;
+    OverlayHeader header;
+    uint8_t* bitmap;
+    uint8_t chunk_dirty[OVL_BITMAP_BYTES / OVL_BITMAP_CHUNK];
+    bool bitmap_dirty; /* some chunk_dirty entry is set */
+    bool header_dirty;
+} Overlay;
+
+static inline bool ovl_test(const Overlay* o, uint32_t s) {
+    return o->bitmap[s / 8] >> (s % 8) & 1;
+}
+
+static inline void ovl_set(Overlay* o, uint32_t s) {
+    if (ovl_test(o, s)) return;
+    o->bitmap[s / 8] |= 1u << (s % 8);
+    o->chunk_dirty[s / 8 / OVL_BITMAP_CHUNK] = 1;
+    o->bitmap_dirty = true;
+}
+
+static inline uint64_t ovl_data(uint64_t sector) {
+    return OVL_DATA_OFFSET + sector * OVL_SECTOR;
+}
+
+/* Full pread/pwrite; a short pread past the end of the file reads zeros */
+static int pread_all(int fd, void* buf, size_t len, uint64_t off) {
+    uint8_t* p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0) return -1;
+        if (n == 0) { memset(p, 0, len); return 0; }
+        p += n; off += (uint64_t)n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void* buf, size_t len, uint64_t off) {
+    const uint8_t* p = buf;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n <= 0) return -1;
+        p += n; off += (uint64_t)n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Sectors from first on that share the allocation state of first */
+static uint32_t ovl_run(const Overlay* o, uint32_t first, uint32_t count) {
+    bool state = ovl_test(o, first);
+    uint32_t n = 1;
+    while (n < count && ovl_test(o, first + n) == state) n++;
+    return n;
+}
+
+static int ovl_read_sectors(Overlay* o, uint32_t first, uint32_t count, uint8_t* out) {
+    while (count) {
+        uint32_t run = ovl_run(o, first, count);
+        size_t len = (size_t)run * OVL_SECTOR;
+        if (ovl_test(o, first)) {
+            if (pread_all(o->fd, out, len, ovl_data(first)) != 0) return -1;
+        } else {
+            if (pread_all(o->base_fd, out, len, (uint64_t)first * OVL_SECTOR) != 0) return -1;
+        }
+        first += run; count -= run; out += len;
+    }
+    return 0;
+}
+
+static bool ovl_in_range(uint64_t off, size_t len) {
+    return off + len <= (uint64_t)OVL_MAX_SECTORS * OVL_SECTOR;
+}
+
+static int ovl_read(BlockBackend* be, uint64_t off, void* buf, size_t len) {
+    Overlay* o = (Overlay*)be;
+    if (!ovl_in_range(off, len)) return -1;
+    uint8_t* out = buf;
+    uint8_t sector[OVL_SECTOR];
+    while (len) {
+        uint32_t s = (uint32_t)(off / OVL_SECTOR);
+        size_t skip = off % OVL_SECTOR;
+        if (skip == 0 && len >= OVL_SECTOR) {
+            uint32_t count = (uint32_t)(len / OVL_SECTOR);
+            if (ovl_read_sectors(o, s, count, out) != 0) return -1;
+            off += (uint64_t)count * OVL_SECTOR; out += (size_t)count * OVL_SECTOR; len -= (size_t)count * OVL_SECTOR;
+        } else {
+            size_t n = OVL_SECTOR - skip < len ? OVL_SECTOR - skip : len;
+            if (ovl_read_sectors(o, s, 1, sector) != 0) return -1;
+            memcpy(out, sector + skip, n);
+            off += n; out += n; len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Write the bitmap chunks and header changed since the last sync */
+static int ovl_sync_metadata(Overlay* o) {
+    for (size_t c = 0; o->bitmap_dirty && c < sizeof(o->chunk_dirty); c++) {
+        if (!o->chunk_dirty[c]) continue;
+        if (pwrite_all(o->fd, o->bitmap + c * OVL_BITMAP_CHUNK, OVL_BITMAP_CHUNK,
+                       OVL_BITMAP_OFFSET + c * OVL_BITMAP_CHUNK) != 0) return -1;
+        o->chunk_dirty[c] = 0;
+    }
+    o->bitmap_dirty = false;
+    if (o->header_dirty) {
+        if (pwrite_all(o->fd, &o->header, sizeof(o->header), 0) != 0) return -1;
+        o->header_dirty = false;
+    }
+    return 0;
+}
+
+static int ovl_write(BlockBackend* be, uint64_t off, const void* buf, size_t len) {
+    Overlay* o = (Overlay*)be;
+    if (!ovl_in_range(off, len)) return -1;
+    const uint8_t* in = buf;
+    uint64_t end = off + len;
+    uint8_t sector[OVL_SECTOR];
+    while (off < end) {
+        uint32_t s = (uint32_t)(off / OVL_SECTOR);
+        size_t skip = off % OVL_SECTOR;
+        if (skip == 0 && end - off >= OVL_SECTOR) {
+            uint32_t count = (uint32_t)((end - off) / OVL_SECTOR);
+            if (pwrite_all(o->fd, in, (size_t)count * OVL_SECTOR, ovl_data(s)) != 0) return -1;
+            for (uint32_t i = 0; i < count; i++) ovl_set(o, s + i);
+            off += (uint64_t)count * OVL_SECTOR; in += (size_t)count * OVL_SECTOR;
+        } else {
+            /* Partial sector: copy it up first */
+            size_t n = OVL_SECTOR - skip < end - off ? OVL_SECTOR - skip : (size_t)(end - off);
+            if (ovl_read_sectors(o, s, 1, sector) != 0) return -1;
+            memcpy(sector + skip, in, n);
+            if (pwrite_all(o->fd, sector, OVL_SECTOR, ovl_data(s)) != 0) return -1;
+            ovl_set(o, s);
+            off += n; in += n;
+        }
+    }
+    if (end > be->size) {
+        be->size = o->header.size = end;
+        o->header_dirty = true;
+    }
+    /* Newly allocated sectors reach the bitmap straight after their data,
+       so the overlay on disk is whole even if the emulator never closes it */
+    return ovl_sync_metadata(o);
+}
+
+static int ovl_flush(BlockBackend* be) {
+    Overlay* o = (Overlay*)be;
+    if (ovl_sync_metadata(o) != 0) return -1;
+    return fsync(o->fd);
+}
+
+static void ovl_free(Overlay* o) {
+    if (o->fd >= 0) close(o->fd);
+    if (o->base_fd >= 0) close(o->base_fd);
+    free(o->bitmap);
+    free(o);
+}
+
+static void ovl_close(BlockBackend* be) {
+    Overlay* o = (Overlay*)be;
+    ovl_sync_metadata(o);
+    ovl_free(o);
+}
+
+static const BlockBackendOps overlay_ops = {
+    .read = ovl_read,
+    .write = ovl_write,
+    .flush = ovl_flush,
+    .close = ovl_close,
+};
+
+/* Only a raw image can be a base: its bytes are read and, on commit,
+   written in place. Sets errno to EINVAL for an overlay or compressed one. */
+static bool ovl_base_is_raw(int fd) {
+    char magic[8];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n == (ssize_t)sizeof(magic) &&
+        (memcmp(magic, OVL_MAGIC, 8) == 0 || memcmp(magic, CMP_MAGIC, 8) == 0)) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+/* The base path as stored, made relative to the overlay's directory */
+static void ovl_base_path(const char* overlay, const char* base, char* out, size_t cap) {
+    const char* slash = strrchr(overlay, '/');
+    if (base[0] == '/' || !slash) snprintf(out, cap, "%s", base);
+    else snprintf(out, cap, "%.*s/%s", (int)(slash - overlay), overlay, base);
+}
+
+static Overlay* ovl_open(const char* path, int base_flags) {
+    Overlay* o = calloc(1, sizeof(Overlay));
+    if (!o) return NULL;
+    o->base_fd = -1;
+    o->fd = open(path, O_RDWR);
+    o->bitmap = malloc(OVL_BITMAP_BYTES);
+    if (o->fd < 0 || !o->bitmap) { ovl_free(o); return NULL; }
+    if (pread_all(o->fd, &o->header, sizeof(o->header), 0) != 0 ||
+        memcmp(o->header.magic, OVL_MAGIC, 8) != 0 || o->header.version != OVL_VERSION ||
+        o->header.sector_size != OVL_SECTOR) {
+        ovl_free(o);
+        return NULL;
+    }
+    o->header.base[sizeof(o->header.base) - 1] = 0;
+    char base[4096];
+    ovl_base_path(path, o->header.base, base, sizeof(base));
+    o->base_fd = open(base, base_flags);
+    if (o->base_fd < 0 || !ovl_base_is_raw(o->base_fd) || pread_all(o->fd, o->bitmap, OVL_BITMAP_BYTES, OVL_BITMAP_OFFSET) != 0) {
+        ovl_free(o);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(o->base_fd, &st) == 0) o->base_size = (uint64_t)st.st_size;
+    o->base.ops = &overlay_ops;
+    o->base.size = o->header.size;
+    return o;
+}
+
+BlockBackend* block_backend_overlay(const char* path) {
+    Overlay* o = ovl_open(path, O_RDONLY);
+    return o ? &o->base : NULL;
+}
+
+int block_overlay_create(const char* path, const char* base) {
+    char resolved[4096];
+    ovl_base_path(path, base, resolved, sizeof(resolved));
+    int base_fd = open(resolved, O_RDONLY);
+    if (base_fd < 0) return -1;
+    struct stat st;
+    bool ok = fstat(base_fd, &st) == 0 && ovl_base_is_raw(base_fd);
+    close(base_fd);
+    if (!ok) return -1;
+
+    OverlayHeader h = {0};
+    memcpy(h.magic, OVL_MAGIC, 8);
+    h.version = OVL_VERSION;
+    h.sector_size = OVL_SECTOR;
+    h.size = (uint64_t)st.st_size;
+    if (strlen(base) >= sizeof(h.base)) return -1;
+    strcpy(h.base, base);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return -1;
+    /* The bitmap is left as a hole: all zeros, nothing allocated */
+    int rc = pwrite_all(fd, &h, sizeof(h), 0);
+    if (rc == 0) rc = ftruncate(fd, (off_t)OVL_DATA_OFFSET);
+    close(fd);
+    return rc;
+}
+
+int64_t block_overlay_commit(const char* path) {
+    Overlay* o = ovl_open(path, O_RDWR);
+    if (!o) return -1;
+    int64_t merged = 0;
+    uint8_t* buf = malloc((size_t)256 * OVL_SECTOR);
+    int rc = buf ? 0 : -1;
+    for (uint32_t s = 0; rc == 0 && s < OVL_MAX_SECTORS;) {
+        /* Skip whole empty bitmap words at a time */
+        if (s % 64 == 0 && ((uint64_t*)o->bitmap)[s / 64] == 0) { s += 64; continue; }
+        if (!ovl_test(o, s)) { s++; continue; }
+        uint32_t run = ovl_run(o, s, OVL_MAX_SECTORS - s < 256 ? OVL_MAX_SECTORS - s : 256);
+        size_t len = (size_t)run * OVL_SECTOR;
+        if (pread_all(o->fd, buf, len, ovl_data(s)) != 0 ||
+            pwrite_all(o->base_fd, buf, len, (uint64_t)s * OVL_SECTOR) != 0) rc = -1;
+        merged += run;
+        s += run;
+    }
+    free(buf);
+    /* The base now holds everything, so keep its size in step and start
+       the overlay over empty */
+    if (rc == 0 && o->header.size > o->base_size && ftruncate(o->base_fd, (off_t)o->header.size) != 0) rc = -1;
+    if (rc == 0) rc = fsync(o->base_fd);
+    if (rc == 0) {
+        memset(o->bitmap, 0, OVL_BITMAP_BYTES);
+        if (ftruncate(o->fd, OVL_BITMAP_OFFSET) != 0 || ftruncate(o->fd, (off_t)OVL_DATA_OFFSET) != 0) rc = -1;
+    }
+    ovl_free(o);
+    return rc == 0 ? merged : -1;
+}
@@ -0,0 +1,45 @@
+#ifndef DEVICES_BLOCK_OVERLAY_H
+#define DEVICES_BLOCK_OVERLAY_H
+
+#include <stdint.h>
+#include "block_backend.h"
+
+/* Copy-on-write overlay: a read-only base image plus a sparse delta file.
+
+   The delta is a 4 KiB header, an allocation bitmap with one bit per
+   sector, then sector n's data at OVL_DATA_OFFSET + n * OVL_SECTOR. Both
+   the bitmap and the data area are holes until written, so a new overlay
+   takes no space and no time whatever the size of the base. */
+
+#define OVL_MAGIC         "ORIONCOW"
+#define OVL_VERSION       1
+#define OVL_SECTOR        512
+#define OVL_HEADER_SIZE   4096
+#define OVL_MAX_SECTORS   (1u << 24) /* the block device's 24-bit sector index */
+#define OVL_BITMAP_OFFSET OVL_HEADER_SIZE
+#define OVL_BITMAP_BYTES  (OVL_MAX_SECTORS / 8)
+#define OVL_BITMAP_CHUNK  4096 /* allocating writes rewrite the bitmap chunks they touch */
+#define OVL_DATA_OFFSET   ((uint64_t)OVL_BITMAP_OFFSET + OVL_BITMAP_BYTES)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sector_size;
+    uint64_t size;  /* image size in bytes as the guest sees it */
+    /* Base image path, NUL-terminated; relative paths are taken from the
+       overlay's directory */
+    char base[OVL_HEADER_SIZE - 24];
+} OverlayHeader;
+
+/* New empty overlay on base; fails if path exists or base is not a raw
+   image (an overlay or compressed image cannot be a base) */
+int block_overlay_create(const char* path, const char* base);
+
+/* Open an overlay for the block device; the base is opened read-only */
+BlockBackend* block_backend_overlay(const char* path);
+
+/* Write every sector held in the overlay into its base, then empty the
+   overlay. Returns the sectors merged, or -1. */
+int64_t block_overlay_commit(const char* path);
+
+#endif
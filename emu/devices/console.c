@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "console.h"
+
+ConsConfig cons_config = {
+    .out = "-",
+    .in = NULL,
+};
+
+/* Largest piece moved through the staging buffer at once */
+#define CONS_STAGE 65536
+
+/* Copy len ring bytes starting at byte position pos between guest RAM and
+   buf. Bytes pack four to a word, so partial words at either end are
+   read, merged and written back whole. */
+static void cons_ring_io(ConsRing* r, uint32_t pos, uint8_t* buf, size_t len, bool to_guest) {
+    while (len) {
+        uint32_t at = pos & (r->size - 1);
+        size_t n = r->size - at < len ? r->size - at : len;
+        uint32_t first = at / 4, last = (uint32_t)((at + n + 3) / 4);
+        uint32_t words[CONS_STAGE / 4 + 2];
+        size_t chunk = n;
+        if (chunk > CONS_STAGE) {
+            chunk = CONS_STAGE;
+            last = (uint32_t)((at + chunk + 3) / 4);
+        }
+        bus_read_block(r->base + first, words, last - first);
+        uint8_t* bytes = (uint8_t*)words + at % 4;
+        if (to_guest) {
+            memcpy(bytes, buf, chunk);
+            bus_write_block(r->base + first, words, last - first);
+        } else {
+            memcpy(buf, bytes, chunk);
+        }
+        pos += (uint32_t)chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+/* Doorbell: send everything queued in one write per staged piece */
+static void cons_transmit(Console* c) {
+    ConsRing* r = &c->tx;
+    if (!r->size) return;
+    c->doorbells++;
+    uint32_t pending = r->tail - r->head;
+    if (pending > r->size) pending = r->size; /* the guest overran; send what the ring holds */
+    while (pending) {
+        size_t n = pending < CONS_STAGE ? pending : CONS_STAGE;
+        cons_ring_io(r, r->head, c->stage, n, false);
+        for (size_t done = 0; c->out_fd >= 0 && done < n;) {
+            ssize_t w = write(c->out_fd, c->stage + done, n - done);
+            if (w <= 0) break;
+            done += (size_t)w;
+        }
+        r->head += (uint32_t)n;
+        pending -= (uint32_t)n;
+        c->tx_bytes += n;
+    }
+    r->head = r->tail;
+}
+
+/* One interrupt until the guest has caught up with the receive ring */
+static void cons_rx_signal(Console* c) {
+    if ((atomic_load_explicit(&c->ctrl, memory_order_relaxed) & CONS_CTRL_RX_IRQ) &&
+        !atomic_exchange_explicit(&c->rx_irq_sent, true, memory_order_acq_rel)) irq_raise(CONS_IRQ);
+}
+
+static inline uint32_t cons_input_count(Console* c) {
+    return atomic_load_explicit(&c->in_tail, memory_order_acquire) -
+           atomic_load_explicit(&c->in_head, memory_order_relaxed);
+}
+
+/* Reader thread: blocks on the input and buffers it, waiting for room
+   when the guest falls CONS_INPUT bytes behind. Stops at end of file. */
+static void* cons_input_loop(void* arg) {
+    Console* c = arg;
+    struct pollfd fds[2] = {
+        { .fd = c->in_fd, .events = POLLIN },
+        { .fd = c->stop[0], .events = POLLIN },
+    };
+    for (;;) {
+        uint32_t tail = atomic_load_explicit(&c->in_tail, memory_order_relaxed);
+        pthread_mutex_lock(&c->lock);
+        while (!c->stopping && tail - atomic_load_explicit(&c->in_head, memory_order_acquire) == CONS_INPUT)
+            pthread_cond_wait(&c->room, &c->lock);
+        bool stopping = c->stopping;
+        pthread_mutex_unlock(&c->lock);
+        if (stopping) break;
+
+        if (poll(fds, 2, -1) < 0) continue;
+        if (fds[1].revents) break;
+        uint32_t space = CONS_INPUT - (tail - atomic_load_explicit(&c->in_head, memory_order_acquire));
+        uint32_t at = tail % CONS_INPUT;
+        ssize_t n = read(c->in_fd, c->in + at, space < CONS_INPUT - at ? space : CONS_INPUT - at);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        /* A terminal reads 0 for ^D and carries on; a file or pipe has ended */
+        if (n == 0 && isatty(c->in_fd)) continue;
+        if (n <= 0) break;
+        atomic_store_explicit(&c->in_tail, tail + (uint32_t)n, memory_order_release);
+        cons_rx_signal(c);
+    }
+    return NULL;
+}
+
+/* Move buffered input into the free part of the receive ring */
+static void cons_deliver(Console* c) {
+    ConsRing* r = &c->rx;
+    if (!r->size || !c->in) return;
+    uint32_t avail = cons_input_count(c);
+    uint32_t room = r->size - (r->tail - r->head);
+    uint32_t n = avail < room ? avail : room;
+    if (!n || room > r->size) return;
+    uint32_t head = atomic_load_explicit(&c->in_head, memory_order_relaxed);
+    while (n) {
+        uint32_t at = head % CONS_INPUT;
+        uint32_t k = n < CONS_INPUT - at ? n : CONS_INPUT - at;
+        cons_ring_io(r, r->tail, c->in + at, k, true);
+        r->tail += k;
+        head += k;
+        n -= k;
+        c->rx_bytes += k;
+    }
+    pthread_mutex_lock(&c->lock);
+    atomic_store_explicit(&c->in_head, head, memory_order_release);
+    pthread_cond_signal(&c->room);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static int cons_open(const char* path, bool out) {
+    if (!path) return -1;
+    if (strcmp(path, "-") == 0) return out ? STDOUT_FILENO : STDIN_FILENO;
+    return out ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY | O_NONBLOCK);
+}
+
+void cons_init(Device* self) {
+    Console* c = self->state;
+    c->stage = malloc(CONS_STAGE);
+    c->out_fd = cons_open(cons_config.out, true);
+    c->in_fd = cons_open(cons_config.in, false);
+    if (c->in_fd < 0) return;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->room, NULL);
+    c->in = malloc(CONS_INPUT);
+    if (c->in && pipe(c->stop) == 0) {
+        c->thread_started = pthread_create(&c->thread, NULL, cons_input_loop, c) == 0;
+    }
+}
+
+void cons_close(Console* c) {
+    if (c->thread_started) {
+        pthread_mutex_lock(&c->lock);
+        c->stopping = true;
+        pthread_cond_signal(&c->room);
+        pthread_mutex_unlock(&c->lock);
+        ssize_t w = write(c->stop[1], "", 1);
+        (void)w;
+        pthread_join(c->thread, NULL);
+        c->thread_started = false;
+        close(c->stop[0]);
+        close(c->stop[1]);
+    }
+    free(c->in);
+    c->in = NULL;
+    if (c->out_fd > STDERR_FILENO) close(c->out_fd);
+    if (c->in_fd > STDERR_FILENO) close(c->in_fd);
+    c->out_fd = c->in_fd = -1;
+    free(c->stage);
+    c->stage = NULL;
+}
+
+static uint32_t cons_ring_size(uint32_t value) {
+    return (value >= 4 && value <= CONS_MAX_RING && !(value & (value - 1))) ? value : 0;
+}
+
+uint32_t cons_read(Device* self, uint32_t addr) {
+    Console* c = self->state;
+    switch (addr) {
+        case CONS_REG_TX_BASE: return c->tx.base;
+        case CONS_REG_TX_SIZE: return c->tx.size;
+        case CONS_REG_TX_HEAD: return c->tx.head;
+        case CONS_REG_TX_TAIL: return c->tx.tail;
+        case CONS_REG_RX_BASE: return c->rx.base;
+        case CONS_REG_RX_SIZE: return c->rx.size;
+        case CONS_REG_RX_HEAD: return c->rx.head;
+        case CONS_REG_RX_TAIL:
+            cons_deliver(c);
+            return c->rx.tail;
+        case CONS_REG_CTRL: return atomic_load_explicit(&c->ctrl, memory_order_relaxed);
+        default: return 0;
+    }
+}
+
+void cons_write(Device* self, uint32_t addr, uint32_t value) {
+    Console* c = self->state;
+    switch (addr) {
+        case CONS_REG_TX_BASE: c->tx.base = value; break;
+        case CONS_REG_TX_SIZE:
+            c->tx.size = cons_ring_size(value);
+            c->tx.head = c->tx.tail = 0;
+            break;
+        case CONS_REG_TX_TAIL:
+            c->tx.tail = value;
+            if (c->stage) cons_transmit(c);
+            break;
+        case CONS_REG_RX_BASE: c->rx.base = value; break;
+        case CONS_REG_RX_SIZE:
+            c->rx.size = cons_ring_size(value);
+            c->rx.head = c->rx.tail = 0;
+            break;
+        case CONS_REG_RX_HEAD:
+            c->rx.head = value;
+            if (c->rx.head == c->rx.tail) {
+                atomic_store_explicit(&c->rx_irq_sent, false, memory_order_release);
+                /* Input that arrived while the ring was full still needs telling */
+                if (c->in && cons_input_count(c)) cons_rx_signal(c);
+            }
+            break;
+        case CONS_REG_CTRL:
+            atomic_store_explicit(&c->ctrl, value & CONS_CTRL_RX_IRQ, memory_order_relaxed);
+            if (c->in && cons_input_count(c)) cons_rx_signal(c);
+            break;
+        default: break;
+    }
+}
+
+Console cons_state = {
+    .out_fd = -1,
+    .in_fd = -1,
+    .stop = {-1, -1},
+};
+
+Device cons_device = {
+    .read = cons_read,
+    .write = cons_write,
+    .init = cons_init,
+    .base = 0x00FB0000,
+    .size = CONS_REG_CTRL,
+    .state = &cons_state,
+};
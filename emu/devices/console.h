@@ -0,0 +1,69 @@
+#ifndef DEVICES_CONSOLE_H
+#define DEVICES_CONSOLE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../device.h"
+
+/* Paravirtual console: a transmit ring and a receive ring of bytes in
+   guest RAM, four bytes to a word with the first in the low byte. Ring
+   positions are free-running byte counts; sizes are powers of two. */
+
+#define CONS_IRQ 5
+
+/* Register offsets from the device base */
+#define CONS_REG_TX_BASE 0x0 /* transmit ring word address */
+#define CONS_REG_TX_SIZE 0x1 /* transmit ring bytes; writing it empties the ring */
+#define CONS_REG_TX_HEAD 0x2 /* read: bytes the device has taken */
+#define CONS_REG_TX_TAIL 0x3 /* bytes the guest has queued; writing it is the doorbell */
+#define CONS_REG_RX_BASE 0x4 /* receive ring word address */
+#define CONS_REG_RX_SIZE 0x5 /* receive ring bytes; writing it empties the ring */
+#define CONS_REG_RX_HEAD 0x6 /* bytes the guest has taken */
+#define CONS_REG_RX_TAIL 0x7 /* read: bytes the device has delivered */
+#define CONS_REG_CTRL    0x8 /* CONS_CTRL_* bits */
+
+#define CONS_CTRL_RX_IRQ 0x1 /* raise CONS_IRQ when input arrives */
+
+#define CONS_MAX_RING    (1u << 24)
+#define CONS_INPUT       65536 /* host-side input buffer, a power of two */
+
+typedef struct {
+    uint32_t base, size, head, tail;
+} ConsRing;
+
+typedef struct {
+    ConsRing tx, rx;
+    atomic_uint ctrl;
+    atomic_bool rx_irq_sent; /* raised, and the guest has not caught up since */
+    int out_fd, in_fd; /* -1 when not attached */
+    uint8_t* stage;
+    uint64_t tx_bytes, rx_bytes, doorbells;
+
+    /* Input: the reader thread fills in from in_fd and raises CONS_IRQ;
+       the CPU thread moves the bytes into the receive ring when the guest
+       reads RX_TAIL, since only it may touch guest RAM. Single producer,
+       single consumer: in_tail is the thread's, in_head the CPU's. */
+    uint8_t* in;                  /* CONS_INPUT bytes */
+    atomic_uint in_head, in_tail; /* free-running; index with % CONS_INPUT */
+    pthread_t thread;
+    bool thread_started;
+    pthread_mutex_t lock;         /* covers stopping; room waits on it */
+    pthread_cond_t room;          /* the CPU thread took some input */
+    bool stopping;
+    int stop[2];                  /* pipe that ends the thread's poll */
+} Console;
+
+/* Set from the command line before the device is registered. "-" means
+   stdout or stdin; anything else is a file or named pipe. */
+typedef struct {
+    const char* out;
+    const char* in;
+} ConsConfig;
+
+extern ConsConfig cons_config;
+extern Console cons_state;
+extern Device cons_device;
+
+void cons_close(Console* c);
+
+#endif
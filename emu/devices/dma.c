@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "dma.h"
+#include "block.h"
+#include "../ram.h"
+#include "../sched.h"
+
+extern Machine* global_machine;
+
+/* Words staged through the stack when one side is not plain RAM */
+#define DMA_CHUNK 256
+
+static uint32_t dma_copy_mem(DMA* d) {
+    if (bus_range_is_ram(d->src, d->len) && bus_range_is_ram(d->dst, d->len)) {
+        ram_move(d->dst, d->src, d->len);
+        return d->len;
+    }
+    /* Through the bus, as memmove does: a destination overlapping the end
+       of the source is copied from the back */
+    uint32_t buf[DMA_CHUNK];
+    bool backward = d->dst > d->src && d->dst - d->src < d->len;
+    for (uint32_t left = d->len; left; ) {
+        uint32_t n = left < DMA_CHUNK ? left : DMA_CHUNK;
+        uint32_t off = backward ? left - n : d->len - left;
+        bus_read_block(d->src + off, buf, n);
+        bus_write_block(d->dst + off, buf, n);
+        left -= n;
+    }
+    return d->len;
+}
+
+/* RAM words hold their bytes lowest first, the same order BLK_REG_DATA32
+   uses, so on a little-endian host the buffer copies straight across. */
+static uint32_t dma_copy_block(DMA* d, bool to_device) {
+    size_t avail;
+    uint8_t* p = block_dma_span(block_state, to_device, &avail);
+    size_t words = avail / sizeof(uint32_t);
+    if (words > d->len) words = d->len;
+    if (to_device) bus_read_block(d->src, p, words);
+    else bus_write_block(d->dst, p, words);
+    if (words) block_dma_done(block_state, to_device, words * sizeof(uint32_t));
+    return (uint32_t)words;
+}
+
+/* The data moves when the modeled latency has passed, not at start */
+static void dma_complete(void* arg) {
+    DMA* d = arg;
+    switch (d->ctrl & DMA_CTRL_DIR) {
+        case DMA_DIR_MEM:        d->done = dma_copy_mem(d); break;
+        case DMA_DIR_BLK_TO_MEM: d->done = dma_copy_block(d, false); break;
+        case DMA_DIR_MEM_TO_BLK: d->done = dma_copy_block(d, true); break;
+        default:                 d->done = 0; break;
+    }
+    d->status = DMA_STATUS_DONE;
+    if (d->done != d->len) d->status |= DMA_STATUS_ERR;
+    if (d->ctrl & DMA_CTRL_IRQ) irq_raise(DMA_IRQ);
+}
+
+static void dma_start(DMA* d) {
+    if (d->status & DMA_STATUS_BUSY) {
+        d->status |= DMA_STATUS_ERR;
+        return;
+    }
+    d->status = DMA_STATUS_BUSY;
+    d->done = 0;
+    uint64_t delay = d->rate ? DMA_SETUP_CYCLES + d->len / d->rate : 0;
+    uint32_t irqs = (d->ctrl & DMA_CTRL_IRQ) ? 1u << DMA_IRQ : 0;
+    if (!sched_at_irq(global_machine->cpu.cycle + delay, dma_complete, d, irqs)) dma_complete(d);
+}
+
+uint32_t dma_read(Device* self, uint32_t addr) {
+    DMA* d = self->state;
+    switch (addr) {
+        case DMA_REG_SRC: return d->src;
+        case DMA_REG_DST: return d->dst;
+        case DMA_REG_LEN: return d->len;
+        case DMA_REG_CTRL: return d->ctrl;
+        case DMA_REG_STATUS: return d->status;
+        case DMA_REG_RATE: return d->rate;
+        case DMA_REG_DONE: return d->done;
+        default: return 0;
+    }
+}
+
+void dma_write(Device* self, uint32_t addr, uint32_t value) {
+    DMA* d = self->state;
+    /* The registers are latched at start; a busy channel ignores them */
+    if ((d->status & DMA_STATUS_BUSY) && addr != DMA_REG_CTRL) return;
+    switch (addr) {
+        case DMA_REG_SRC: d->src = value; break;
+        case DMA_REG_DST: d->dst = value; break;
+        case DMA_REG_LEN: d->len = value; break;
+        case DMA_REG_CTRL:
+            if (value & DMA_CTRL_START) {
+                if (!(d->status & DMA_STATUS_BUSY)) d->ctrl = value & ~DMA_CTRL_START;
+                dma_start(d);
+            } else if (!(d->status & DMA_STATUS_BUSY)) {
+                d->ctrl = value;
+            }
+            break;
+        case DMA_REG_RATE: d->rate = value; break;
+        default: break;
+    }
+}
+
+DMA dma_state = {
+    .rate = DMA_WORDS_PER_CYCLE,
+};
+
+Device dma_device = {
+    .read = dma_read,
+    .write = dma_write,
+    .base = 0x00FD0000,
+    .size = DMA_REG_DONE,
+    .state = &dma_state,
+};
@@ -0,0 +1,42 @@
+#ifndef DEVICES_DMA_H
+#define DEVICES_DMA_H
+
+#include "../device.h"
+
+#define DMA_IRQ 3
+
+/* Register offsets from the device base */
+#define DMA_REG_SRC    0x0 /* source word address (unused for DMA_DIR_BLK_TO_MEM) */
+#define DMA_REG_DST    0x1 /* destination word address (unused for DMA_DIR_MEM_TO_BLK) */
+#define DMA_REG_LEN    0x2 /* words to move */
+#define DMA_REG_CTRL   0x3 /* DMA_DIR_* in bits 1..0, DMA_CTRL_* flags; DMA_CTRL_START begins */
+#define DMA_REG_STATUS 0x4 /* read: DMA_STATUS_* bits */
+#define DMA_REG_RATE   0x5 /* words moved per cycle for the latency model, 0 for none */
+#define DMA_REG_DONE   0x6 /* read: words moved by the last transfer */
+
+#define DMA_DIR_MEM        0 /* memory to memory */
+#define DMA_DIR_BLK_TO_MEM 1 /* block device buffer to memory, as BLK_REG_DATA32 reads */
+#define DMA_DIR_MEM_TO_BLK 2 /* memory to block device buffer, as BLK_REG_DATA32 writes */
+
+#define DMA_CTRL_DIR   0x03
+#define DMA_CTRL_IRQ   0x10 /* raise DMA_IRQ on completion */
+#define DMA_CTRL_START 0x80
+
+#define DMA_STATUS_BUSY 0x1
+#define DMA_STATUS_DONE 0x2 /* cleared by the next start */
+#define DMA_STATUS_ERR  0x4 /* busy at start, or the block buffer ran short */
+
+#define DMA_SETUP_CYCLES    32 /* fixed cost of every transfer */
+#define DMA_WORDS_PER_CYCLE 8
+
+typedef struct {
+    uint32_t src, dst, len, ctrl;
+    uint32_t status;
+    uint32_t rate;
+    uint32_t done;
+} DMA;
+
+extern DMA dma_state;
+extern Device dma_device;
+
+#endif
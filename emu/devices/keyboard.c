@@ -1,55 +1,148 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "keyboard.h"
 
+KbdConfig kbd_config = {
+    .read_stdin = true,
+    .buffer_size = 64,
+};
+
+static inline uint32_t kbd_count(Keyboard* k) {
+    return atomic_load_explicit(&k->tail, memory_order_acquire) -
+           atomic_load_explicit(&k->head, memory_order_relaxed);
+}
+
+/* Producer side, input thread only */
+static void kbd_push(Keyboard* k, uint8_t c) {
+    uint32_t tail = atomic_load_explicit(&k->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&k->head, memory_order_acquire);
+    if (tail - head > k->mask) {
+        atomic_fetch_add_explicit(&k->overflow, 1, memory_order_relaxed);
+        return;
+    }
+    k->buffer[tail & k->mask] = c;
+    atomic_store_explicit(&k->tail, tail + 1, memory_order_release);
+}
+
+/* One interrupt per burst: it is raised again only after the guest has
+   emptied the buffer. */
+static void kbd_signal(Keyboard* k) {
+    if (!atomic_exchange_explicit(&k->irq_sent, true, memory_order_acq_rel)) irq_raise(KBD_IRQ);
+}
+
+/* Consumer side, called once the guest has emptied the buffer */
+static void kbd_drained(Keyboard* k) {
+    atomic_store_explicit(&k->irq_sent, false, memory_order_release);
+    /* A byte pushed before irq_sent was cleared would otherwise go unnoticed */
+    if (kbd_count(k) != 0) kbd_signal(k);
+}
+
+static void* kbd_input_loop(void* arg) {
+    Keyboard* k = arg;
+    struct pollfd fds[2] = {
+        { .fd = k->inject[0], .events = POLLIN },
+        { .fd = kbd_config.read_stdin ? STDIN_FILENO : -1, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) continue;
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP))) continue;
+            uint8_t buf[64];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n <= 0) {
+                fds[i].fd = -1; /* EOF: stop polling it */
+                continue;
+            }
+            bool pushed = false;
+            for (ssize_t j = 0; j < n; j++) {
+                if (i == 1 && kbd_config.stdin_hook && kbd_config.stdin_hook(buf[j])) continue;
+                kbd_push(k, buf[j]);
+                pushed = true;
+            }
+            if (pushed) kbd_signal(k);
+        }
+    }
+    return NULL;
+}
+
+void kbd_init(Device* self) {
+    Keyboard* k = self->state;
+    uint32_t size = 1;
+    while (size < kbd_config.buffer_size && size < (1u << 30)) size <<= 1;
+    k->buffer = calloc(size, 1);
+    if (!k->buffer) return;
+    k->mask = size - 1;
+
+    if (pipe(k->inject) != 0) {
+        k->inject[0] = k->inject[1] = -1;
+        return;
+    }
+    pthread_create(&k->thread, NULL, kbd_input_loop, k);
+    pthread_detach(k->thread);
+}
+
+void kbd_inject(Device* self, char c) {
+    Keyboard* k = self->state;
+    if (k->inject[1] < 0) return;
+    ssize_t r = write(k->inject[1], &c, 1);
+    (void)r;
+}
+
 void kbd_write(Device* self, uint32_t addr, uint32_t value) {
     Keyboard* k = self->state;
     switch (addr) {
-        case 0x2: {
+        case KBD_REG_CTRL: {
             if (value == 1) {
-                k->head = k->tail = k->count = 0;
-                k->status = 0;
+                atomic_store_explicit(&k->head, atomic_load_explicit(&k->tail, memory_order_acquire), memory_order_release);
+                kbd_drained(k);
             }
             break;
         }
     }
 }
 
+/* Pop up to max bytes into the low bytes of a word, first byte lowest */
+static uint32_t kbd_pop(Keyboard* k, uint32_t max) {
+    uint32_t n = kbd_count(k);
+    if (n == 0) return 0;
+    if (n > max) n = max;
+
+    uint32_t head = atomic_load_explicit(&k->head, memory_order_relaxed);
+    uint32_t word = 0;
+    for (uint32_t i = 0; i < n; i++) word |= (uint32_t)k->buffer[(head + i) & k->mask] << (8 * i);
+    atomic_store_explicit(&k->head, head + n, memory_order_release);
+
+    if (kbd_count(k) == 0) kbd_drained(k);
+    return word;
+}
+
 uint32_t kbd_read(Device* self, uint32_t addr) {
     Keyboard* k = self->state;
+    if (!k->buffer) return 0;
     switch (addr) {
-        case 0x0: {
-            if (k->count == 0) return 0;
-            uint8_t b = k->buffer[k->head];
-            k->head = (k->head + 1) % sizeof(k->buffer);
-            k->count--;
-            k->status = (k->count > 0) ? 1 : 0;
-            return b;
-        }
-        case 0x1: return k->status;
+        case KBD_REG_DATA: return kbd_pop(k, 1);
+        case KBD_REG_STATUS: return kbd_count(k) > 0 ? 1 : 0;
+        case KBD_REG_LEVEL: return kbd_count(k);
+        case KBD_REG_PACKED: return kbd_pop(k, 4);
+        case KBD_REG_OVERFLOW: return atomic_load_explicit(&k->overflow, memory_order_relaxed);
         default: return 0;
     }
 }
 
-void kbd_push(Device* self, char c) {
-    Keyboard* k = self->state;
-    if (k->count == sizeof(k->buffer)) return;
-    k->buffer[k->tail] = c;
-    k->tail = (k->tail + 1) % sizeof(k->buffer);
-    k->count++;
-    k->status = 1;
-}
-
 Keyboard kbd_state = {
-    .buffer = {0},
+    .buffer = NULL,
     .head = 0,
     .tail = 0,
-    .count = 0,
-    .status = 0,
+    .inject = {-1, -1},
 };
 
 Device kbd_device = (Device){
     .read = kbd_read,
     .write = kbd_write,
+    .init = kbd_init,
     .base = 0x00FF0000,
-    .size = 0x2,
+    .size = KBD_REG_OVERFLOW,
     .state = &kbd_state,
-};
\ No newline at end of file
+};
@@ -1,21 +1,52 @@
 #ifndef DEVICES_KEYBOARD_H
 #define DEVICES_KEYBOARD_H
 
+#include <stdatomic.h>
+#include <pthread.h>
 #include "../device.h"
 
+#define KBD_IRQ 1
+
+/* Register offsets from the device base */
+#define KBD_REG_DATA     0x0 /* read: next byte, 0 when empty */
+#define KBD_REG_STATUS   0x1 /* read: 1 while bytes are waiting */
+#define KBD_REG_CTRL     0x2 /* write 1: discard everything waiting */
+#define KBD_REG_LEVEL    0x3 /* read: bytes waiting */
+#define KBD_REG_PACKED   0x4 /* read: up to four bytes, first in the low byte, zero-padded */
+#define KBD_REG_OVERFLOW 0x5 /* read: bytes dropped because the buffer was full */
+
+void kbd_init(Device* self);
+
 void kbd_write(Device* self, uint32_t addr, uint32_t value);
 
 uint32_t kbd_read(Device* self, uint32_t addr);
 
-void kbd_push(Device* self, char c);
+/* Queue a byte from any thread; the input thread delivers it to the guest */
+void kbd_inject(Device* self, char c);
 
+/* Single-producer/single-consumer ring: only the input thread pushes and
+   only the CPU thread pops, so head and tail each have one writer. */
 typedef struct {
-    uint8_t buffer[64];
-    uint8_t head, tail, count;
-    uint32_t status;
+    uint8_t* buffer;
+    uint32_t mask;          /* buffer size - 1; the size is a power of two */
+    atomic_uint head, tail; /* free-running; index with & mask */
+    atomic_uint overflow;
+    atomic_bool irq_sent;   /* IRQ raised and the guest has not drained yet */
+    int inject[2];          /* pipe other threads write injected bytes to */
+    pthread_t thread;
 } Keyboard;
 
+/* Set from the command line before the device is registered */
+typedef struct {
+    bool read_stdin;      /* the input thread also reads the terminal */
+    /* Sees each terminal byte first, on the input thread; returning true
+       keeps the byte from the guest */
+    bool (*stdin_hook)(uint8_t c);
+    uint32_t buffer_size; /* rounded up to a power of two */
+} KbdConfig;
+
+extern KbdConfig kbd_config;
 extern Keyboard kbd_state;
 extern Device kbd_device;
 
-#endif
\ No newline at end of file
+#endif
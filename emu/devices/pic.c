@@ -0,0 +1,172 @@
+#include <pthread.h>
+
+#include "pic.h"
+#include "../ram.h"
+
+_Atomic uint32_t irq_pending;
+_Atomic uint32_t irq_lost;
+_Atomic bool irq_sleeping;
+
+static pthread_mutex_t wfi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wfi_wake = PTHREAD_COND_INITIALIZER;
+
+/* Raisers set their bit before looking at irq_sleeping and pic_wait sets
+   irq_sleeping before looking at the bits, both sequentially consistent,
+   so one of the two always sees the other. */
+void irq_wake(void) {
+    pthread_mutex_lock(&wfi_lock);
+    pthread_cond_signal(&wfi_wake);
+    pthread_mutex_unlock(&wfi_lock);
+}
+
+void pic_wait(PIC* p) {
+    pthread_mutex_lock(&wfi_lock);
+    atomic_store(&irq_sleeping, true);
+    while (!(atomic_load(&irq_pending) & p->enabled) && !atomic_load(&cpu_kick))
+        pthread_cond_wait(&wfi_wake, &wfi_lock);
+    atomic_store(&irq_sleeping, false);
+    pthread_mutex_unlock(&wfi_lock);
+}
+
+/* Highest priority among the lines in set, or -1 for none */
+static int pic_top_prio(PIC* p, uint32_t set) {
+    for (uint32_t used = p->prio_used; used; ) {
+        int prio = 31 - __builtin_clz(used);
+        if (set & p->by_prio[prio]) return prio;
+        used &= ~(1u << prio);
+    }
+    return -1;
+}
+
+/* Recomputes the enabled word after a mask, priority or in-service change */
+static void pic_update(PIC* p) {
+    uint32_t blocked = 0;
+    int top = pic_top_prio(p, p->in_service);
+    for (int prio = 0; prio <= top; prio++) blocked |= p->by_prio[prio];
+    p->enabled = ~p->mask & ~blocked;
+}
+
+static void pic_set_prio(PIC* p, uint32_t first, uint32_t value) {
+    for (uint32_t i = 0; i < 8; i++) p->prio[first + i] = (value >> (i * 4)) & 0xF;
+    for (int prio = 0; prio < 16; prio++) p->by_prio[prio] = 0;
+    for (uint32_t line = 0; line < PIC_LINES; line++) p->by_prio[p->prio[line]] |= 1u << line;
+    p->prio_used = 0;
+    for (int prio = 0; prio < 16; prio++)
+        if (p->by_prio[prio]) p->prio_used |= 1u << prio;
+    pic_update(p);
+}
+
+uint32_t pic_ack(PIC* p) {
+    uint32_t ready = atomic_load_explicit(&irq_pending, memory_order_acquire) & p->enabled;
+    int prio = pic_top_prio(p, ready);
+    if (prio < 0) return PIC_NONE;
+    uint32_t line = __builtin_ctz(ready & p->by_prio[prio]);
+    uint32_t bit = 1u << line;
+    /* A level line stays pending until its device lowers it */
+    if (!(p->level & bit))
+        atomic_fetch_and_explicit(&irq_pending, ~bit, memory_order_acq_rel);
+    if (!(p->ctrl & PIC_CTRL_AUTO_EOI)) {
+        p->in_service |= bit;
+        pic_update(p);
+    }
+    return line;
+}
+
+static void pic_eoi(PIC* p, uint32_t line) {
+    if (line == PIC_NONE) {
+        int prio = pic_top_prio(p, p->in_service);
+        if (prio < 0) return;
+        line = __builtin_ctz(p->in_service & p->by_prio[prio]);
+    }
+    if (line >= PIC_LINES) return;
+    p->in_service &= ~(1u << line);
+    pic_update(p);
+}
+
+/* The old table goes back to RAM and the new one is loaded from it */
+static void pic_move_vectors(PIC* p, uint32_t base) {
+    ram_write_block(p->vbase, p->vectors, PIC_LINES);
+    ram_read_block(base, p->vectors, PIC_LINES);
+    p->vbase = base;
+    pic_vec_device.base = base;
+}
+
+uint32_t pic_read(Device* self, uint32_t addr) {
+    PIC* p = self->state;
+    switch (addr) {
+        case PIC_REG_PENDING: return atomic_load_explicit(&irq_pending, memory_order_acquire);
+        case PIC_REG_MASK: return p->mask;
+        case PIC_REG_LEVEL: return p->level;
+        case PIC_REG_INSERVICE: return p->in_service;
+        case PIC_REG_ACK: return pic_ack(p);
+        case PIC_REG_CTRL: return p->ctrl;
+        case PIC_REG_LOST: return atomic_load_explicit(&irq_lost, memory_order_relaxed);
+        case PIC_REG_VBASE: return p->vbase;
+        case PIC_REG_PRIO:
+        case PIC_REG_PRIO + 1:
+        case PIC_REG_PRIO + 2:
+        case PIC_REG_PRIO + 3: {
+            uint32_t first = (addr - PIC_REG_PRIO) * 8, v = 0;
+            for (uint32_t i = 0; i < 8; i++) v |= (uint32_t)p->prio[first + i] << (i * 4);
+            return v;
+        }
+        default: return 0;
+    }
+}
+
+void pic_write(Device* self, uint32_t addr, uint32_t value) {
+    PIC* p = self->state;
+    switch (addr) {
+        case PIC_REG_PENDING:
+            atomic_fetch_and_explicit(&irq_pending, ~value, memory_order_acq_rel);
+            break;
+        case PIC_REG_MASK: p->mask = value; pic_update(p); break;
+        case PIC_REG_LEVEL: p->level = value; break;
+        case PIC_REG_EOI: pic_eoi(p, value); break;
+        case PIC_REG_CTRL:
+            p->ctrl = value;
+            if (value & PIC_CTRL_AUTO_EOI) {
+                p->in_service = 0;
+                pic_update(p);
+            }
+            break;
+        case PIC_REG_LOST: atomic_store_explicit(&irq_lost, 0, memory_order_relaxed); break;
+        case PIC_REG_PRIO:
+        case PIC_REG_PRIO + 1:
+        case PIC_REG_PRIO + 2:
+        case PIC_REG_PRIO + 3:
+            pic_set_prio(p, (addr - PIC_REG_PRIO) * 8, value);
+            break;
+        case PIC_REG_RAISE: if (value < PIC_LINES) irq_raise(value); break;
+        case PIC_REG_VBASE: pic_move_vectors(p, value); break;
+        default: break;
+    }
+}
+
+void pic_init(Device* self) {
+    PIC* p = self->state;
+    pic_set_prio(p, 0, 0);
+    ram_read_block(p->vbase, p->vectors, PIC_LINES);
+}
+
+/* Auto-EOI by default so handlers written before the PIC, which never
+   end their interrupts, keep working */
+PIC pic_state = {
+    .ctrl = PIC_CTRL_AUTO_EOI,
+    .vbase = PIC_VECTOR_BASE,
+};
+
+Device pic_device = {
+    .read = pic_read,
+    .write = pic_write,
+    .init = pic_init,
+    .base = 0x00FA0000,
+    .size = PIC_REG_VBASE,
+    .state = &pic_state,
+};
+
+Device pic_vec_device = {
+    .base = PIC_VECTOR_BASE,
+    .size = PIC_LINES - 1,
+    .mem = pic_state.vectors,
+};
@@ -0,0 +1,67 @@
+#ifndef DEVICES_PIC_H
+#define DEVICES_PIC_H
+
+#include "../device.h"
+
+/* Interrupt controller: devices raise lines into the irq_pending bitmap
+   from any thread; the CPU takes the highest-priority line that is
+   pending and enabled. Priorities run 0..15, higher first, and lines of
+   equal priority go lowest first. */
+
+#define PIC_LINES 32
+
+/* Register offsets from the device base */
+#define PIC_REG_PENDING   0x0 /* read: lines pending; write: 1 bits drop them */
+#define PIC_REG_MASK      0x1 /* 1 bits keep a line from interrupting */
+#define PIC_REG_LEVEL     0x2 /* 1 bits make a line level-triggered */
+#define PIC_REG_INSERVICE 0x3 /* read: lines acknowledged and not yet ended */
+#define PIC_REG_ACK       0x4 /* read: highest deliverable line, now acknowledged, or PIC_NONE */
+#define PIC_REG_EOI       0x5 /* write: a line to end, or PIC_NONE for the highest in service */
+#define PIC_REG_CTRL      0x6 /* PIC_CTRL_* flags */
+#define PIC_REG_LOST      0x7 /* read: edge raises that found the line still pending; write clears */
+#define PIC_REG_PRIO      0x8 /* 0x8..0xB: four bits per line, line 0 in the low bits of 0x8 */
+#define PIC_REG_RAISE     0xC /* write: raise a line as an edge */
+#define PIC_REG_VBASE     0xD /* word address of the vector table */
+
+#define PIC_CTRL_AUTO_EOI 0x1 /* acknowledged lines do not stay in service */
+
+#define PIC_NONE 0xFFFFFFFF
+
+#define PIC_VECTOR_BASE 0x1234 /* where the table starts until VBASE moves it */
+
+typedef struct {
+    uint32_t mask;
+    uint32_t level;
+    uint32_t in_service;
+    uint32_t ctrl;
+    uint8_t prio[PIC_LINES];
+    uint32_t by_prio[16];   /* lines at each priority */
+    uint32_t prio_used;     /* priorities with at least one line */
+    /* Lines that may interrupt now: unmasked and above everything in
+       service. step() tests irq_pending against this one word. */
+    uint32_t enabled;
+    /* The vector table for the lines lives here rather than in RAM:
+       pic_vec_device maps it at vbase, so guest stores to the table land
+       straight in the copy interrupt entry reads. */
+    uint32_t vbase;
+    uint32_t vectors[PIC_LINES];
+} PIC;
+
+/* Acknowledges the highest deliverable line and returns it, or PIC_NONE */
+uint32_t pic_ack(PIC* p);
+
+/* Blocks the CPU thread until a line that may interrupt is pending, or
+   cpu_kick is set */
+void pic_wait(PIC* p);
+
+extern PIC pic_state;
+extern Device pic_device;
+extern Device pic_vec_device;
+
+/* Handler for vector n; vectors past the lines are plain memory */
+static inline uint32_t pic_vector(PIC* p, int32_t n) {
+    if ((uint32_t)n < PIC_LINES) return p->vectors[n];
+    return bus_read(p->vbase + n);
+}
+
+#endif
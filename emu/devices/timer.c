@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <time.h>
+
+#include "timer.h"
+#include "../sched.h"
+
+extern Machine* global_machine;
+
+static uint64_t timer_clock_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Count the expiry and, for a periodic timer, move the deadline past now.
+   Periods missed while the guest or host was held up are counted as
+   ticks but raise one interrupt. */
+static void timer_expire(Timer* t, uint64_t now) {
+    uint64_t n = 1;
+    if ((t->ctrl & TIMER_CTRL_PERIODIC) && t->period) {
+        n += (now - t->deadline) / t->period;
+        t->deadline += n * t->period;
+    } else {
+        t->ctrl &= ~TIMER_CTRL_ENABLE;
+    }
+    t->ticks += (uint32_t)n;
+    if (t->ctrl & TIMER_CTRL_IRQ) irq_raise(TIMER_IRQ);
+}
+
+/* A timer without TIMER_CTRL_IRQ cannot wake a CPU in WFI */
+static uint32_t timer_irqs(Timer* t) {
+    return (t->ctrl & TIMER_CTRL_IRQ) ? 1u << TIMER_IRQ : 0;
+}
+
+static void timer_cycle_event(void* arg) {
+    Timer* t = arg;
+    pthread_mutex_lock(&t->lock);
+    timer_expire(t, global_machine->cpu.cycle);
+    if (t->ctrl & TIMER_CTRL_ENABLE) sched_at_irq(t->deadline, timer_cycle_event, t, timer_irqs(t));
+    pthread_mutex_unlock(&t->lock);
+}
+
+static bool timer_host_armed(Timer* t) {
+    return (t->ctrl & (TIMER_CTRL_ENABLE | TIMER_CTRL_HOST)) == (TIMER_CTRL_ENABLE | TIMER_CTRL_HOST);
+}
+
+static void* timer_host_loop(void* arg) {
+    Timer* t = arg;
+    pthread_mutex_lock(&t->lock);
+    while (!t->stop) {
+        if (!timer_host_armed(t)) {
+            pthread_cond_wait(&t->wake, &t->lock);
+            continue;
+        }
+        struct timespec ts = {
+            .tv_sec = (time_t)(t->deadline / 1000000),
+            .tv_nsec = (long)(t->deadline % 1000000) * 1000,
+        };
+        /* Woken early means re-armed or stopping: look again */
+        if (pthread_cond_timedwait(&t->wake, &t->lock, &ts) != ETIMEDOUT) continue;
+        uint64_t now = timer_clock_us(CLOCK_MONOTONIC);
+        if (timer_host_armed(t) && now >= t->deadline) timer_expire(t, now);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static bool timer_start_thread(Timer* t) {
+    if (t->started) return true;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    t->started = pthread_create(&t->thread, NULL, timer_host_loop, t) == 0;
+    return t->started;
+}
+
+static void timer_arm(Timer* t, uint32_t ctrl) {
+    sched_cancel(timer_cycle_event, t);
+    t->ctrl = ctrl;
+    if (t->started) pthread_cond_signal(&t->wake);
+    if (!(ctrl & TIMER_CTRL_ENABLE) || !t->period) {
+        t->ctrl &= ~TIMER_CTRL_ENABLE;
+        return;
+    }
+    t->ticks = 0;
+    if (ctrl & TIMER_CTRL_HOST) {
+        t->deadline = timer_clock_us(CLOCK_MONOTONIC) + t->period;
+    } else {
+        t->deadline = global_machine->cpu.cycle + t->period;
+        sched_at_irq(t->deadline, timer_cycle_event, t, timer_irqs(t));
+    }
+}
+
+static uint32_t timer_count(Timer* t) {
+    if (!(t->ctrl & TIMER_CTRL_ENABLE)) return 0;
+    uint64_t now = (t->ctrl & TIMER_CTRL_HOST) ? timer_clock_us(CLOCK_MONOTONIC) : global_machine->cpu.cycle;
+    return now < t->deadline ? (uint32_t)(t->deadline - now) : 0;
+}
+
+static uint32_t timer_split(Timer* t, uint64_t v) {
+    t->latch = (uint32_t)(v >> 32);
+    return (uint32_t)v;
+}
+
+uint32_t timer_read(Device* self, uint32_t addr) {
+    Timer* t = self->state;
+    uint32_t v = 0;
+    pthread_mutex_lock(&t->lock);
+    switch (addr) {
+        case TIMER_REG_CTRL: v = t->ctrl; break;
+        case TIMER_REG_PERIOD: v = t->period; break;
+        case TIMER_REG_COUNT: v = timer_count(t); break;
+        case TIMER_REG_TICKS: v = t->ticks; break;
+        case TIMER_REG_MONO_LO: v = timer_split(t, timer_clock_us(CLOCK_MONOTONIC) - t->start_us); break;
+        case TIMER_REG_WALL_LO: v = timer_split(t, timer_clock_us(CLOCK_REALTIME)); break;
+        case TIMER_REG_CYCLE_LO: v = timer_split(t, global_machine->cpu.cycle); break;
+        case TIMER_REG_MONO_HI:
+        case TIMER_REG_WALL_HI:
+        case TIMER_REG_CYCLE_HI: v = t->latch; break;
+        default: break;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return v;
+}
+
+void timer_write(Device* self, uint32_t addr, uint32_t value) {
+    Timer* t = self->state;
+    pthread_mutex_lock(&t->lock);
+    switch (addr) {
+        case TIMER_REG_CTRL:
+            /* The host thread starts the first time it is needed */
+            if ((value & TIMER_CTRL_ENABLE) && (value & TIMER_CTRL_HOST) && !timer_start_thread(t))
+                value &= ~TIMER_CTRL_ENABLE;
+            timer_arm(t, value);
+            break;
+        case TIMER_REG_PERIOD: t->period = value; break; /* used from the next expiry or arm */
+        default: break;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void timer_init(Device* self) {
+    Timer* t = self->state;
+    pthread_mutex_init(&t->lock, NULL);
+    t->start_us = timer_clock_us(CLOCK_MONOTONIC);
+}
+
+void timer_close(Timer* t) {
+    if (!t->started) return;
+    pthread_mutex_lock(&t->lock);
+    t->stop = true;
+    pthread_cond_signal(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    t->started = false;
+}
+
+Timer timer_state;
+
+Device timer_device = {
+    .read = timer_read,
+    .write = timer_write,
+    .init = timer_init,
+    .base = 0x00F90000,
+    .size = TIMER_REG_CYCLE_HI,
+    .state = &timer_state,
+};
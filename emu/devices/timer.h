@@ -0,0 +1,51 @@
+#ifndef DEVICES_TIMER_H
+#define DEVICES_TIMER_H
+
+#include <pthread.h>
+#include "../device.h"
+
+/* Interval timer and clock. The timer counts guest cycles through the
+   scheduler, or host microseconds on its own thread; either way nothing
+   is checked per step. The 64-bit counters read low half first: reading
+   the low register latches the high one. */
+
+#define TIMER_IRQ 0
+
+/* Register offsets from the device base */
+#define TIMER_REG_CTRL     0x0 /* TIMER_CTRL_* bits; a write with TIMER_CTRL_ENABLE (re)arms */
+#define TIMER_REG_PERIOD   0x1 /* cycles, or microseconds with TIMER_CTRL_HOST */
+#define TIMER_REG_COUNT    0x2 /* read: cycles or microseconds left until the next expiry */
+#define TIMER_REG_TICKS    0x3 /* read: expiries since the timer was armed */
+#define TIMER_REG_MONO_LO  0x4 /* read: host microseconds since the emulator started */
+#define TIMER_REG_MONO_HI  0x5
+#define TIMER_REG_WALL_LO  0x6 /* read: host wall-clock microseconds since the Unix epoch */
+#define TIMER_REG_WALL_HI  0x7
+#define TIMER_REG_CYCLE_LO 0x8 /* read: guest cycles executed */
+#define TIMER_REG_CYCLE_HI 0x9
+
+#define TIMER_CTRL_ENABLE   0x1
+#define TIMER_CTRL_PERIODIC 0x2 /* re-arm after each expiry; one-shot otherwise */
+#define TIMER_CTRL_HOST     0x4 /* count host monotonic microseconds instead of guest cycles */
+#define TIMER_CTRL_IRQ      0x8 /* raise TIMER_IRQ on expiry */
+
+typedef struct {
+    uint32_t ctrl;
+    uint32_t period;
+    uint64_t deadline;  /* guest cycle, or host monotonic microseconds */
+    uint32_t ticks;
+    uint32_t latch;     /* high half of the last 64-bit counter read */
+    uint64_t start_us;
+    /* Host mode: the thread sleeps until the deadline or a re-arm. The
+       lock covers everything above once the thread is running. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool started, stop;
+} Timer;
+
+extern Timer timer_state;
+extern Device timer_device;
+
+void timer_close(Timer* t);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vblk.h"
+#include "block.h"
+
+/* Largest request: the most data one descriptor chain may carry */
+#define VBLK_MAX_SECTORS BLK_MERGE_SECTORS
+#define VBLK_MAX_SEGS    64
+
+VBlkConfig vblk_config = {
+    .path = NULL,
+};
+
+typedef struct {
+    uint32_t addr, len, flags;
+} VBlkSeg;
+
+static uint32_t desc_word(VBlk* v, uint32_t index, uint32_t field) {
+    return bus_read(v->desc + index * 4 + field);
+}
+
+/* Whether the buffers in segs line up with what type does to them: the
+   device only writes buffers marked VBLK_DESC_F_WRITE and only reads the
+   others */
+static bool vblk_segs_match(const VBlkSeg* segs, uint32_t nsegs, uint32_t type) {
+    if (!(segs[nsegs - 1].flags & VBLK_DESC_F_WRITE)) return false;
+    if (type != VBLK_T_IN && type != VBLK_T_OUT) return true;
+    uint32_t want = type == VBLK_T_IN ? VBLK_DESC_F_WRITE : 0;
+    for (uint32_t i = 1; i + 1 < nsegs; i++)
+        if ((segs[i].flags & VBLK_DESC_F_WRITE) != want) return false;
+    return true;
+}
+
+/* Walk one chain from head and carry it out. Returns the words written
+   into guest buffers, status included; *ok is false when the chain itself
+   is malformed and nothing was done. */
+static uint32_t vblk_request(VBlk* v, uint32_t head, bool* ok) {
+    VBlkSeg segs[VBLK_MAX_SEGS];
+    uint32_t nsegs = 0, index = head, flags;
+    uint32_t hops = 0;
+    *ok = false;
+    /* Collect header, buffers and status; a chain longer than the table is a loop */
+    do {
+        if (index >= v->size || nsegs == VBLK_MAX_SEGS || hops++ > v->size) return 0;
+        segs[nsegs].addr = desc_word(v, index, VBLK_DESC_ADDR);
+        segs[nsegs].len = desc_word(v, index, VBLK_DESC_LEN);
+        flags = segs[nsegs].flags = desc_word(v, index, VBLK_DESC_FLAGS);
+        nsegs++;
+        index = desc_word(v, index, VBLK_DESC_NEXT);
+    } while (flags & VBLK_DESC_F_NEXT);
+    if (nsegs < 2 || segs[0].len < 2 || segs[nsegs - 1].len < 1) return 0;
+
+    uint32_t type = bus_read(segs[0].addr);
+    uint32_t sector = bus_read(segs[0].addr + 1);
+    uint32_t status_addr = segs[nsegs - 1].addr;
+    if (!vblk_segs_match(segs, nsegs, type)) return 0;
+    *ok = true;
+    if (!v->backend) {
+        bus_write(status_addr, VBLK_S_IOERR);
+        return 1;
+    }
+
+    uint64_t words = 0;
+    for (uint32_t i = 1; i + 1 < nsegs; i++) words += segs[i].len;
+    size_t bytes = (size_t)words * sizeof(uint32_t);
+
+    if (type == VBLK_T_FLUSH) {
+        bus_write(status_addr, v->backend->ops->flush(v->backend) == 0 ? VBLK_S_OK : VBLK_S_IOERR);
+        return 1;
+    }
+    if (type != VBLK_T_IN && type != VBLK_T_OUT) {
+        bus_write(status_addr, VBLK_S_UNSUPP);
+        return 1;
+    }
+    if (bytes % SECTOR_SIZE || bytes > (size_t)VBLK_MAX_SECTORS * SECTOR_SIZE ||
+        (uint64_t)sector + bytes / SECTOR_SIZE > (1u << 24)) {
+        bus_write(status_addr, VBLK_S_IOERR);
+        return 1;
+    }
+
+    uint64_t off = (uint64_t)sector * SECTOR_SIZE;
+    int rc;
+    if (type == VBLK_T_IN) {
+        rc = v->backend->ops->read(v->backend, off, v->stage, bytes);
+        if (rc == 0) {
+            size_t pos = 0;
+            for (uint32_t i = 1; i + 1 < nsegs; i++) {
+                bus_write_block(segs[i].addr, v->stage + pos, segs[i].len);
+                pos += (size_t)segs[i].len * sizeof(uint32_t);
+            }
+        }
+    } else {
+        size_t pos = 0;
+        for (uint32_t i = 1; i + 1 < nsegs; i++) {
+            bus_read_block(segs[i].addr, v->stage + pos, segs[i].len);
+            pos += (size_t)segs[i].len * sizeof(uint32_t);
+        }
+        rc = v->backend->ops->write(v->backend, off, v->stage, bytes);
+    }
+    bus_write(status_addr, rc == 0 ? VBLK_S_OK : VBLK_S_IOERR);
+    /* The status word counts as written too */
+    return (type == VBLK_T_IN && rc == 0 ? (uint32_t)words : 0) + 1;
+}
+
+/* Take every request posted since the last notify; publish the used index
+   once and interrupt once for the whole batch */
+static void vblk_notify(VBlk* v) {
+    if (!v->size || (v->status & VBLK_STATUS_ERROR)) return;
+    uint32_t avail_idx = bus_read(v->avail + VBLK_RING_IDX);
+    /* More new entries than the ring holds means a bad index, not work */
+    if (avail_idx - v->last_avail > v->size) {
+        v->status |= VBLK_STATUS_ERROR;
+        return;
+    }
+    uint32_t done = 0;
+    while (v->last_avail != avail_idx) {
+        uint32_t head = bus_read(v->avail + VBLK_RING_ENTRY + (v->last_avail & (v->size - 1)));
+        bool ok;
+        uint32_t written = vblk_request(v, head, &ok);
+        /* A malformed chain stops the queue until it is set up again */
+        if (!ok) { v->status |= VBLK_STATUS_ERROR; break; }
+        uint32_t slot = v->used + VBLK_RING_ENTRY + 2 * (v->used_idx & (v->size - 1));
+        bus_write(slot, head);
+        bus_write(slot + 1, written);
+        v->used_idx++;
+        v->last_avail++;
+        done++;
+    }
+    if (!done) return;
+    bus_write(v->used + VBLK_RING_IDX, v->used_idx);
+    v->requests += done;
+    v->batches++;
+    v->isr = 1;
+    bool no_irq = bus_read(v->avail + VBLK_RING_FLAGS) & VBLK_AVAIL_F_NO_IRQ;
+    if ((v->ctrl & VBLK_CTRL_IRQ) && !no_irq) irq_raise(VBLK_IRQ);
+}
+
+void vblk_init(Device* self) {
+    VBlk* v = self->state;
+    v->stage = malloc((size_t)VBLK_MAX_SECTORS * SECTOR_SIZE);
+    if (vblk_config.path && v->stage) {
+        v->backend = block_backend_open(vblk_config.path, block_config.mmap);
+        if (v->backend && block_config.cache_sectors) {
+            BlockBackend* cached = block_cache_new(v->backend, block_config.cache_sectors);
+            if (cached) v->backend = cached;
+        }
+    }
+    if (v->backend) v->status |= VBLK_STATUS_DISK;
+}
+
+void vblk_close(VBlk* v) {
+    if (v->backend) v->backend->ops->close(v->backend);
+    v->backend = NULL;
+    free(v->stage);
+    v->stage = NULL;
+}
+
+uint32_t vblk_read(Device* self, uint32_t addr) {
+    VBlk* v = self->state;
+    switch (addr) {
+        case VBLK_REG_DESC: return v->desc;
+        case VBLK_REG_AVAIL: return v->avail;
+        case VBLK_REG_USED: return v->used;
+        case VBLK_REG_SIZE: return v->size;
+        case VBLK_REG_STATUS: return v->status;
+        case VBLK_REG_ISR: {
+            uint32_t isr = v->isr;
+            v->isr = 0;
+            return isr;
+        }
+        case VBLK_REG_CAPACITY: return v->backend ? (uint32_t)(v->backend->size / SECTOR_SIZE) : 0;
+        case VBLK_REG_CTRL: return v->ctrl;
+        default: return 0;
+    }
+}
+
+void vblk_write(Device* self, uint32_t addr, uint32_t value) {
+    VBlk* v = self->state;
+    switch (addr) {
+        case VBLK_REG_DESC: v->desc = value; break;
+        case VBLK_REG_AVAIL: v->avail = value; break;
+        case VBLK_REG_USED: v->used = value; break;
+        case VBLK_REG_SIZE:
+            /* (Re)arms the queue: both rings start over from index 0 */
+            v->size = (value && value <= VBLK_MAX_QUEUE && !(value & (value - 1))) ? value : 0;
+            v->last_avail = v->used_idx = 0;
+            v->status &= ~VBLK_STATUS_ERROR;
+            break;
+        case VBLK_REG_NOTIFY: vblk_notify(v); break;
+        case VBLK_REG_CTRL: v->ctrl = value & VBLK_CTRL_IRQ; break;
+        default: break;
+    }
+}
+
+VBlk vblk_state;
+
+Device vblk_device = {
+    .read = vblk_read,
+    .write = vblk_write,
+    .init = vblk_init,
+    .base = 0x00FC0000,
+    .size = VBLK_REG_CTRL,
+    .state = &vblk_state,
+};
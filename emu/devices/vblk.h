@@ -0,0 +1,77 @@
+#ifndef DEVICES_VBLK_H
+#define DEVICES_VBLK_H
+
+#include "../device.h"
+#include "block_backend.h"
+
+/* Paravirtual block device: requests are descriptor chains in guest RAM,
+   posted through an available ring and completed through a used ring.
+   All addresses are word addresses and all lengths are in words. */
+
+#define VBLK_IRQ 4
+
+/* Register offsets from the device base */
+#define VBLK_REG_DESC     0x0 /* descriptor table address */
+#define VBLK_REG_AVAIL    0x1 /* available ring address */
+#define VBLK_REG_USED     0x2 /* used ring address */
+#define VBLK_REG_SIZE     0x3 /* descriptors and ring entries, a power of two up to VBLK_MAX_QUEUE */
+#define VBLK_REG_NOTIFY   0x4 /* write: process everything posted since the last notify */
+#define VBLK_REG_STATUS   0x5 /* read: VBLK_STATUS_* bits */
+#define VBLK_REG_ISR      0x6 /* read: 1 when completions were posted since the last read, then 0 */
+#define VBLK_REG_CAPACITY 0x7 /* read: disk size in sectors */
+#define VBLK_REG_CTRL     0x8 /* VBLK_CTRL_* bits */
+
+#define VBLK_MAX_QUEUE 256
+
+#define VBLK_STATUS_DISK  0x1 /* a disk image is attached */
+#define VBLK_STATUS_ERROR 0x2 /* a bad ring index or descriptor chain; cleared by writing VBLK_REG_SIZE */
+
+#define VBLK_CTRL_IRQ 0x1 /* raise VBLK_IRQ once per batch of completions */
+
+/* Descriptor: four words at desc + 4 * index */
+#define VBLK_DESC_ADDR  0
+#define VBLK_DESC_LEN   1
+#define VBLK_DESC_FLAGS 2
+#define VBLK_DESC_NEXT  3
+#define VBLK_DESC_F_NEXT  0x1 /* the chain continues at VBLK_DESC_NEXT */
+#define VBLK_DESC_F_WRITE 0x2 /* the device writes this buffer */
+
+/* Rings: word 0 flags, word 1 free-running index, then the entries. Used
+   entries are two words: head descriptor, words written. */
+#define VBLK_RING_FLAGS 0
+#define VBLK_RING_IDX   1
+#define VBLK_RING_ENTRY 2
+#define VBLK_AVAIL_F_NO_IRQ 0x1 /* the guest will poll; skip the interrupt */
+
+/* A request chain: a 2-word header (type, sector), data buffers whose
+   lengths add up to whole sectors, then a 1-word status the device fills */
+#define VBLK_T_IN    0 /* read sectors into the buffers */
+#define VBLK_T_OUT   1 /* write the buffers to sectors */
+#define VBLK_T_FLUSH 4
+
+#define VBLK_S_OK     0
+#define VBLK_S_IOERR  1
+#define VBLK_S_UNSUPP 2
+
+typedef struct {
+    BlockBackend* backend;
+    uint32_t desc, avail, used, size;
+    uint32_t last_avail; /* next available entry to take */
+    uint32_t used_idx;
+    uint32_t status, isr, ctrl;
+    uint8_t* stage;      /* one request's data */
+    uint64_t requests, batches;
+} VBlk;
+
+/* Set from the command line before the device is registered */
+typedef struct {
+    const char* path; /* disk image; the device reports no disk without one */
+} VBlkConfig;
+
+extern VBlkConfig vblk_config;
+extern VBlk vblk_state;
+extern Device vblk_device;
+
+void vblk_close(VBlk* v);
+
+#endif
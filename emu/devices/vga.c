@@ -1,23 +1,72 @@
-#include <SDL2/SDL.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
 #include "vga.h"
+#include "keyboard.h"
 #include "font.h"
 #include "device.h"
 
+VGAConfig vga_config = {
+    .refresh_hz = 60,
+#ifndef HAVE_SDL
+    .headless = true,
+#endif
+};
+
+/* Set from SIGUSR1; the presenter writes a capture on its next frame */
+static atomic_bool capture_pending;
+
+static void vga_capture_signal(int sig) {
+    (void)sig;
+    atomic_store(&capture_pending, true);
+}
+
+static void vga_compile_font(void);
+static void* vga_present_loop(void* arg);
+
 void vga_init(Device* self) {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) return;
+    VGA* vga = (VGA*)calloc(1, sizeof(VGA));
+    if (!vga) return;
 
-    VGA* vga = (VGA*)malloc(sizeof(VGA));
-    if (!vga) {
-        SDL_Quit();
+    vga->width = (int)VGA_W;
+    vga->height = (int)VGA_H;
+    vga->mem = calloc(VGA_CELLS, sizeof(uint32_t));
+    vga->snap = calloc(VGA_CELLS, sizeof(uint32_t));
+    vga->last = calloc(VGA_CELLS, sizeof(uint32_t));
+    vga->fb = calloc(VGA_FB_WORDS, sizeof(uint32_t));
+    if (!vga->mem || !vga->snap || !vga->last || !vga->fb) {
+        free(vga->mem);
+        free(vga->snap);
+        free(vga->last);
+        free(vga->fb);
+        free(vga);
         return;
     }
+    for (uint32_t i = 0; i < 256; ++i) vga->palette[i] = i << 24 | i << 16 | i << 8;
 
-    vga->width = (int)VGA_W;
-    vga->height = (int)VGA_H;
-    vga->mem = malloc(sizeof(uint32_t) * VGA_H * VGA_W);
+    self->state = vga;
+    vga_text_device.mem = vga->mem;
+    vga_fb_device.mem = vga->fb;
+    vga_compile_font();
+    if (vga_config.capture_path) signal(SIGUSR1, vga_capture_signal);
+
+    /* SDL wants the window created, drawn and pumped from one thread, so
+       all of it lives on the presenter; the CPU thread only stores words. */
+    atomic_store(&vga->running, true);
+    if (pthread_create(&vga->thread, NULL, vga_present_loop, vga) != 0) {
+        atomic_store(&vga->running, false);
+    }
+}
+
+#ifdef HAVE_SDL
+static bool vga_open_window(VGA* vga) {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) return false;
 
     vga->window = SDL_CreateWindow("Orion",
                                   SDL_WINDOWPOS_UNDEFINED,
@@ -26,103 +75,559 @@ void vga_init(Device* self) {
                                   vga->height,
                                   SDL_WINDOW_SHOWN);
     if (!vga->window) {
-        free(vga);
-        free(vga->mem);
         SDL_Quit();
-        return;
+        return false;
     }
 
     vga->surface = SDL_GetWindowSurface(vga->window);
+    /* Drawing writes whole 32-bit pixels; any other window format gets a
+       32-bit shadow surface that is blitted across, converting, on present */
+    if (vga->surface && vga->surface->format->BytesPerPixel != 4) {
+        vga->window_surface = vga->surface;
+        vga->surface = SDL_CreateRGBSurfaceWithFormat(0, vga->width, vga->height, 32, SDL_PIXELFORMAT_RGB888);
+    }
     if (!vga->surface) {
         SDL_DestroyWindow(vga->window);
-        free(vga);
-        free(vga->mem);
+        vga->window = NULL;
+        vga->window_surface = NULL;
         SDL_Quit();
-        return;
+        return false;
     }
+    SDL_StartTextInput();
+    return true;
+}
+#endif
 
-    self->state = vga;
+/* The font compiled to one bit per pixel (bit CHAR_W - 1 is the leftmost
+   column), indexed directly by character code. */
+static uint16_t glyph_rows[256][CHAR_H];
+
+/* Characters missing from font.h stay blank, like its final fallback entry */
+static void vga_compile_font(void) {
+    for (size_t i = 0; i < 96; ++i) {
+        uint8_t c = (uint8_t)font[i].c;
+        for (int y = 0; y < CHAR_H; ++y) {
+            uint16_t row = 0;
+            for (int x = 0; x < CHAR_W; ++x) {
+                row = (row << 1) | (font[i].val[y * CHAR_W + x] != '.');
+            }
+            glyph_rows[c][y] = row;
+        }
+    }
 }
 
-void vga_putpixel(VGA* vga, int x, int y, uint32_t colour) {
-    if (!vga || !vga->window || !vga->surface || !vga->surface->locked) return;
+#ifdef HAVE_SDL
+/* Pre-render every glyph in the surface's own pixel format, so drawing a cell
+   is one CHAR_W-pixel copy per row. vga_open_window guarantees the surface
+   is 32 bits per pixel. */
+static bool vga_build_atlas(VGA* vga) {
+    vga->atlas = malloc(sizeof(uint32_t) * 256 * CHAR_H * CHAR_W);
+    if (!vga->atlas) return false;
 
-    SDL_PixelFormat *fmt = vga->surface->format;
-    int rloss = fmt->Rloss, gloss = fmt->Gloss, bloss = fmt->Bloss, aloss = fmt->Aloss;
-    int rshift = fmt->Rshift, gshift = fmt->Gshift, bshift = fmt->Bshift, ashift = fmt->Ashift;
+    const SDL_PixelFormat* fmt = vga->surface->format;
+    uint32_t fg = SDL_MapRGB(fmt, (VGA_FG >> 24) & 0xFF, (VGA_FG >> 16) & 0xFF, (VGA_FG >> 8) & 0xFF);
+    uint32_t bg = SDL_MapRGB(fmt, (VGA_BG >> 24) & 0xFF, (VGA_BG >> 16) & 0xFF, (VGA_BG >> 8) & 0xFF);
 
-        uint8_t *dst_row = (uint8_t*)vga->surface->pixels + y * vga->surface->pitch;
-        uint32_t *dst = (uint32_t*)dst_row;
-        uint32_t s = colour;
-        uint32_t r = (s >> 24) & 0xFF;
-        uint32_t g = (s >> 16) & 0xFF;
-        uint32_t b = (s >> 8)  & 0xFF;
-        uint32_t a = 0xFF;
+    uint32_t* px = vga->atlas;
+    for (int c = 0; c < 256; ++c) {
+        for (int y = 0; y < CHAR_H; ++y) {
+            for (int x = 0; x < CHAR_W; ++x) {
+                *px++ = (glyph_rows[c][y] >> (CHAR_W - 1 - x)) & 1 ? fg : bg;
+            }
+        }
+    }
+    return true;
+}
 
-        uint32_t packed =
-            ((r >> rloss) << rshift) |
-            ((g >> gloss) << gshift) |
-            ((b >> bloss) << bshift) |
-            ((a >> aloss) << ashift);
+static inline void vga_drawchar(VGA* vga, uint8_t c, int dst_x, int dst_y) {
+    const uint32_t* src = vga->atlas + (size_t)c * CHAR_H * CHAR_W;
+    int pitch = vga->surface->pitch;
+    uint8_t* dst = (uint8_t*)vga->surface->pixels + dst_y * pitch + dst_x * sizeof(uint32_t);
 
-        dst[x] = packed;
+    for (int y = 0; y < CHAR_H; ++y) {
+        memcpy(dst, src, CHAR_W * sizeof(uint32_t));
+        dst += pitch;
+        src += CHAR_W;
+    }
+}
+#endif
 
+/* Copy the displayed screen into vga->snap, starting at the start-address
+   register and wrapping round the buffer. Single-word stores are atomic on
+   their own; bulk updates bump vga->seq to odd while in progress, so retry
+   until a copy was taken with no bulk update in flight. */
+static void vga_snapshot(VGA* vga) {
+    for (;;) {
+        unsigned s1 = atomic_load_explicit(&vga->seq, memory_order_acquire);
+        if (s1 & 1) continue;
+        uint32_t start = atomic_load_explicit(&vga->start, memory_order_relaxed);
+        memcpy(vga->snap, vga->mem + start, sizeof(uint32_t) * (VGA_CELLS - start));
+        memcpy(vga->snap + VGA_CELLS - start, vga->mem, sizeof(uint32_t) * start);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&vga->seq, memory_order_relaxed) == s1) return;
+    }
 }
 
-void vga_drawchar(VGA* vga, Font* c, int dst_x, int dst_y) {
-    if (!vga || !c || !c->val) return;
+/* Mark every cell of the snapshot that differs from the last rendered frame */
+static void vga_scan(VGA* vga) {
+    for (int i = 0; i < VGA_CELLS; ++i) {
+        if (vga->snap[i] != vga->last[i]) {
+            vga->last[i] = vga->snap[i];
+            vga->dirty[i / 64] |= 1ull << (i % 64);
+        }
+    }
+}
 
-    for (int y = 0; y < CHAR_H; ++y) {
-        for (int x = 0; x < CHAR_W; ++x) {
-            if (c->val[y * CHAR_W + x] != '.') {
-                vga_putpixel(vga, dst_x + x, dst_y + y, 0xFFFFFF00);
+#ifdef HAVE_SDL
+/* Put rects of the drawn surface on screen, converting through the
+   window's own surface when the two differ */
+static void vga_present(VGA* vga, const SDL_Rect* rects, int nrects) {
+    if (vga->window_surface) {
+        for (int i = 0; i < nrects; ++i) {
+            SDL_Rect dst = rects[i];
+            SDL_BlitSurface(vga->surface, &rects[i], vga->window_surface, &dst);
+        }
+    }
+    SDL_UpdateWindowSurfaceRects(vga->window, rects, nrects);
+}
+
+static void vga_render(VGA* vga) {
+    int nrects = 0;
+
+    SDL_LockSurface(vga->surface);
+
+    for (int w = 0; w < VGA_DIRTY_WORDS; ++w) {
+        uint64_t bits = vga->dirty[w];
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            int x = i % VGA_COLS, y = i / VGA_COLS;
+            vga_drawchar(vga, getbyte(vga->last[i], 32), x * CHAR_W, y * CHAR_H);
+
+            /* Extend the previous rectangle when this cell continues its run */
+            SDL_Rect* r = nrects ? &vga->rects[nrects - 1] : NULL;
+            if (r && r->y == y * CHAR_H && r->x + r->w == x * CHAR_W) {
+                r->w += CHAR_W;
+            } else {
+                vga->rects[nrects++] = (SDL_Rect){ x * CHAR_W, y * CHAR_H, CHAR_W, CHAR_H };
             }
         }
     }
+
+    SDL_UnlockSurface(vga->surface);
+
+    if (nrects) vga_present(vga, vga->rects, nrects);
 }
 
-Font* vga_getchar(char c) {
-    for(size_t i = 0; i < 96; i++)
-        if(font[i].c == c) return &font[i];
-    return font + 96;
+/* Surface pixel for a 0xRRGGBBxx colour; the surface is 32 bits per pixel */
+static inline uint32_t vga_native(const SDL_PixelFormat* fmt, uint32_t colour) {
+    return ((colour >> 24) & 0xFF) << fmt->Rshift |
+           ((colour >> 16) & 0xFF) << fmt->Gshift |
+           ((colour >> 8) & 0xFF) << fmt->Bshift |
+           fmt->Amask;
 }
 
-void vga_render(VGA* vga) {
-    if (!vga || !vga->window || !vga->surface) return;
+/* Copy the whole framebuffer to the window, once per frame */
+static void vga_render_fb(VGA* vga, uint32_t mode) {
+    const SDL_PixelFormat* fmt = vga->surface->format;
+    uint32_t lut[256];
+    if (mode == VGA_MODE_INDEXED) {
+        for (int i = 0; i < 256; ++i) lut[i] = vga_native(fmt, vga->palette[i]);
+    }
 
     SDL_LockSurface(vga->surface);
+    for (int y = 0; y < VGA_H; ++y) {
+        uint32_t* dst = (uint32_t*)((uint8_t*)vga->surface->pixels + y * vga->surface->pitch);
+        if (mode == VGA_MODE_RGB) {
+            const uint32_t* src = vga->fb + y * VGA_W;
+            for (int x = 0; x < VGA_W; ++x) dst[x] = vga_native(fmt, src[x]);
+        } else {
+            const uint32_t* src = vga->fb + y * (VGA_W / 4);
+            for (int x = 0; x < VGA_W; ++x) dst[x] = lut[(src[x / 4] >> (8 * (x % 4))) & 0xFF];
+        }
+    }
+    SDL_UnlockSurface(vga->surface);
+    vga_present(vga, &(SDL_Rect){ 0, 0, VGA_W, VGA_H }, 1);
+}
 
-    int cols = vga->width / CHAR_W;
-    int rows = vga->height / CHAR_H;
+/* Keys that produce no text input event but still mean a byte to the guest */
+static char vga_key_byte(SDL_Keycode sym) {
+    switch (sym) {
+        case SDLK_RETURN: return '\n';
+        case SDLK_BACKSPACE: return '\b';
+        case SDLK_TAB: return '\t';
+        case SDLK_ESCAPE: return 0x1B;
+        default: return 0;
+    }
+}
 
-    for (int y = 0; y < rows; ++y) {
-        for (int x = 0; x < cols; ++x) {
-            vga_drawchar(vga, vga_getchar(getbyte(vga->mem[y * cols + x], 32)), x * CHAR_W, y * CHAR_H);
+static void vga_pump_events(VGA* vga) {
+    (void)vga;
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        switch (e.type) {
+            /* To the process, not this thread, which has SIGINT blocked */
+            case SDL_QUIT: kill(getpid(), SIGINT); break;
+            case SDL_TEXTINPUT:
+                for (const char* t = e.text.text; *t; t++) kbd_inject(&kbd_device, *t);
+                break;
+            case SDL_KEYDOWN: {
+                char c = vga_key_byte(e.key.keysym.sym);
+                if (c) kbd_inject(&kbd_device, c);
+                break;
+            }
         }
     }
+}
+#endif
 
-    SDL_UnlockSurface(vga->surface);
-    SDL_UpdateWindowSurface(vga->window);
+static inline char vga_printable(uint32_t cell) {
+    uint8_t c = getbyte(cell, 32);
+    return (c >= 0x20 && c < 0x7F) ? (char)c : ' ';
+}
+
+/* Mirror the dirty cells to a terminal, moving the cursor only when a cell
+   does not follow on from the previous one. */
+static void vga_mirror(const VGA* vga) {
+    int prev = -2;
+    for (int w = 0; w < VGA_DIRTY_WORDS; ++w) {
+        uint64_t bits = vga->dirty[w];
+        while (bits) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (i != prev + 1 || i % VGA_COLS == 0) {
+                printf("\x1b[%d;%dH", i / VGA_COLS + 1, i % VGA_COLS + 1);
+            }
+            putchar(vga_printable(vga->last[i]));
+            prev = i;
+        }
+    }
+    if (prev >= 0) fflush(stdout);
+}
+
+static void vga_capture_text(FILE* f, const uint32_t* cells) {
+    for (int y = 0; y < VGA_ROWS; ++y) {
+        char line[VGA_COLS + 1];
+        int len = 0;
+        for (int x = 0; x < VGA_COLS; ++x) {
+            line[x] = vga_printable(cells[y * VGA_COLS + x]);
+            if (line[x] != ' ') len = x + 1;
+        }
+        line[len] = '\0';
+        fprintf(f, "%s\n", line);
+    }
+}
+
+/* Colour of pixel (x, y) as 0xRRGGBBxx in the current mode */
+static uint32_t vga_pixel(const VGA* vga, uint32_t mode, const uint32_t* cells, int x, int y) {
+    switch (mode) {
+        case VGA_MODE_RGB: return vga->fb[y * VGA_W + x];
+        case VGA_MODE_INDEXED: {
+            uint32_t word = vga->fb[y * (VGA_W / 4) + x / 4];
+            return vga->palette[(word >> (8 * (x % 4))) & 0xFF];
+        }
+        default: {
+            uint8_t c = getbyte(cells[(y / CHAR_H) * VGA_COLS + x / CHAR_W], 32);
+            bool lit = (glyph_rows[c][y % CHAR_H] >> (CHAR_W - 1 - x % CHAR_W)) & 1;
+            return lit ? VGA_FG : VGA_BG;
+        }
+    }
+}
+
+static void vga_capture_ppm(FILE* f, const VGA* vga, const uint32_t* cells) {
+    uint32_t mode = atomic_load_explicit(&vga->mode, memory_order_relaxed);
+    uint8_t row[VGA_W * 3];
+
+    fprintf(f, "P6\n%d %d\n255\n", VGA_W, VGA_H);
+    for (int y = 0; y < VGA_H; ++y) {
+        for (int x = 0; x < VGA_W; ++x) {
+            uint32_t colour = vga_pixel(vga, mode, cells, x, y);
+            row[x * 3 + 0] = (colour >> 24) & 0xFF;
+            row[x * 3 + 1] = (colour >> 16) & 0xFF;
+            row[x * 3 + 2] = (colour >> 8) & 0xFF;
+        }
+        fwrite(row, 1, sizeof(row), f);
+    }
+}
+
+/* Write the screen to vga_config.capture_path: PPM when it ends in ".ppm",
+   text otherwise (the text buffer, whatever the mode). A "%d" in the path is replaced by the frame number. */
+static void vga_capture(const VGA* vga, const uint32_t* cells) {
+    const char* path = vga_config.capture_path;
+    char name[4096];
+    const char* mark = strstr(path, "%d");
+    if (mark) {
+        snprintf(name, sizeof(name), "%.*s%" PRIu64 "%s", (int)(mark - path), path,
+                 (uint64_t)atomic_load(&vga->stats.frames), mark + 2);
+        path = name;
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        perror("vga capture");
+        return;
+    }
+    size_t len = strlen(path);
+    if (len >= 4 && strcmp(path + len - 4, ".ppm") == 0) vga_capture_ppm(f, vga, cells);
+    else vga_capture_text(f, cells);
+    fclose(f);
+}
+
+static void vga_frame_text(VGA* vga) {
+    vga_snapshot(vga);
+    vga_scan(vga);
+
+    /* Coming back from a graphics mode, every cell has to be drawn again */
+    if (vga->shown_mode != VGA_MODE_TEXT) {
+        memset(vga->dirty, 0xFF, sizeof(vga->dirty));
+        if (VGA_CELLS % 64) vga->dirty[VGA_DIRTY_WORDS - 1] = (1ull << (VGA_CELLS % 64)) - 1;
+        vga->shown_mode = VGA_MODE_TEXT;
+    }
+
+    uint32_t drawn = 0;
+    for (int w = 0; w < VGA_DIRTY_WORDS; ++w) drawn += __builtin_popcountll(vga->dirty[w]);
+
+    if (drawn) {
+#ifdef HAVE_SDL
+        if (vga->window) vga_render(vga);
+#endif
+        if (vga_config.ansi) vga_mirror(vga);
+        memset(vga->dirty, 0, sizeof(vga->dirty));
+        vga->stats.cells_total += drawn;
+    }
+    vga->stats.cells_drawn = drawn;
+}
+
+static void vga_frame(VGA* vga) {
+    uint32_t mode = atomic_load_explicit(&vga->mode, memory_order_relaxed);
+    if (mode == VGA_MODE_TEXT) {
+        vga_frame_text(vga);
+    } else {
+#ifdef HAVE_SDL
+        if (vga->window) vga_render_fb(vga, mode);
+#endif
+        vga->shown_mode = mode;
+    }
+
+    uint64_t frames = atomic_fetch_add_explicit(&vga->stats.frames, 1, memory_order_relaxed) + 1;
+    atomic_store_explicit(&vga->vsync, true, memory_order_release);
+
+    if (vga_config.capture_path) {
+        bool every = vga_config.capture_every > 0 && frames % (uint64_t)vga_config.capture_every == 0;
+        if (every || atomic_exchange(&capture_pending, false)) vga_capture(vga, vga->last);
+    }
+}
+
+static void* vga_present_loop(void* arg) {
+    VGA* vga = arg;
+
+#ifdef HAVE_SDL
+    /* Fall back to running headless when there is no display to open */
+    if (!vga_config.headless && vga_open_window(vga) && !vga_build_atlas(vga)) {
+        if (vga->window_surface) SDL_FreeSurface(vga->surface);
+        SDL_DestroyWindow(vga->window);
+        vga->window = NULL;
+        vga->surface = NULL;
+        vga->window_surface = NULL;
+        SDL_Quit();
+    }
+#endif
+    if (vga_config.ansi) printf("\x1b[2J");
+
+    int hz = vga_config.refresh_hz > 0 ? vga_config.refresh_hz : 60;
+    long period = 1000000000L / hz;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (atomic_load_explicit(&vga->running, memory_order_relaxed)) {
+#ifdef HAVE_SDL
+        if (vga->window) vga_pump_events(vga);
+#endif
+        vga_frame(vga);
+
+        next.tv_nsec += period;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+#ifdef HAVE_SDL
+    if (vga->window) {
+        if (vga->window_surface) SDL_FreeSurface(vga->surface);
+        SDL_DestroyWindow(vga->window);
+        vga->window = NULL;
+        vga->surface = NULL;
+        vga->window_surface = NULL;
+        SDL_Quit();
+    }
+    free(vga->atlas);
+    vga->atlas = NULL;
+#endif
+    return NULL;
 }
 
 void vga_destroy(VGA* vga) {
-    if (!vga) return;
-    if (vga->window) SDL_DestroyWindow(vga->window);
+    if (!vga || vga == &vga_state) return;
+    if (atomic_exchange(&vga->running, false)) pthread_join(vga->thread, NULL);
+    if (vga_config.capture_path) {
+        vga_snapshot(vga);
+        vga_capture(vga, vga->snap);
+    }
     if (vga->mem) free(vga->mem);
-    SDL_Quit();
+    if (vga->snap) free(vga->snap);
+    if (vga->last) free(vga->last);
+    if (vga->fb) free(vga->fb);
     free(vga);
 }
 
+uint32_t vga_read(Device* self, uint32_t addr) {
+    VGA* vga = self->state;
+    switch (addr) {
+        case VGA_REG_STATUS: {
+            /* Frames presented so far, plus bit 0 set once per new frame */
+            uint32_t frames = (uint32_t)atomic_load_explicit(&vga->stats.frames, memory_order_relaxed);
+            bool vsync = atomic_exchange_explicit(&vga->vsync, false, memory_order_acquire);
+            return (frames << 1) | vsync;
+        }
+        case VGA_REG_START: return atomic_load_explicit(&vga->start, memory_order_relaxed);
+        case VGA_REG_MODE: return atomic_load_explicit(&vga->mode, memory_order_relaxed);
+        case VGA_REG_PAL_INDEX: return vga->pal_index;
+        default: return 0;
+    }
+}
+
+/* Bracket a multi-word update of the text buffer so the presenter never
+   snapshots it half done */
+static inline void vga_begin_update(VGA* vga) {
+    atomic_fetch_add_explicit(&vga->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void vga_end_update(VGA* vga) {
+    atomic_fetch_add_explicit(&vga->seq, 1, memory_order_release);
+}
+
+static void vga_fill(uint32_t* dst, uint32_t value, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] = value;
+}
+
+/* The screen is a ring over the buffer starting at the start-address
+   register: screen cell i lives at mem[(start + i) % VGA_CELLS]. Scrolls
+   and fills work in screen cells and never move START. */
+static inline uint32_t vga_cell(uint32_t start, size_t i) {
+    return (uint32_t)((start + i) % VGA_CELLS);
+}
+
+/* Fill n screen cells from cell i, in at most two runs either side of the wrap */
+static void vga_fill_span(VGA* vga, uint32_t start, size_t i, uint32_t value, size_t n) {
+    uint32_t at = vga_cell(start, i);
+    size_t first = n < VGA_CELLS - at ? n : VGA_CELLS - at;
+    vga_fill(vga->mem + at, value, first);
+    vga_fill(vga->mem, value, n - first);
+}
+
+/* Scroll the screen up by lines (down when negative), blanking the rows
+   that are uncovered */
+static void vga_scroll(VGA* vga, int32_t lines) {
+    if (lines == 0) return;
+    vga_begin_update(vga);
+    uint32_t start = atomic_load_explicit(&vga->start, memory_order_relaxed);
+    int32_t n = lines < 0 ? -lines : lines;
+    if (n >= VGA_ROWS) {
+        vga_fill(vga->mem, 0, VGA_CELLS);
+    } else {
+        size_t keep = (size_t)(VGA_ROWS - n) * VGA_COLS;
+        size_t gap = (size_t)n * VGA_COLS;
+        if (lines > 0) {
+            uint32_t dst = start, src = vga_cell(start, gap);
+            for (size_t i = 0; i < keep; ++i) {
+                vga->mem[dst] = vga->mem[src];
+                if (++dst == VGA_CELLS) dst = 0;
+                if (++src == VGA_CELLS) src = 0;
+            }
+            vga_fill_span(vga, start, keep, 0, gap);
+        } else {
+            uint32_t dst = vga_cell(start, VGA_CELLS - 1), src = vga_cell(start, keep - 1);
+            for (size_t i = 0; i < keep; ++i) {
+                vga->mem[dst] = vga->mem[src];
+                dst = dst ? dst - 1 : VGA_CELLS - 1;
+                src = src ? src - 1 : VGA_CELLS - 1;
+            }
+            vga_fill_span(vga, start, 0, 0, gap);
+        }
+    }
+    vga_end_update(vga);
+}
+
+/* Fill the rectangle in vga->rect with value, clipped to the screen */
+static void vga_fill_rect(VGA* vga, uint32_t value) {
+    uint32_t x = vga->rect & 0xFF, y = (vga->rect >> 8) & 0xFF;
+    uint32_t w = (vga->rect >> 16) & 0xFF, h = (vga->rect >> 24) & 0xFF;
+    if (x >= VGA_COLS || y >= VGA_ROWS) return;
+    if (x + w > VGA_COLS) w = VGA_COLS - x;
+    if (y + h > VGA_ROWS) h = VGA_ROWS - y;
+
+    vga_begin_update(vga);
+    uint32_t start = atomic_load_explicit(&vga->start, memory_order_relaxed);
+    for (uint32_t row = y; row < y + h; ++row) {
+        vga_fill_span(vga, start, (size_t)row * VGA_COLS + x, value, w);
+    }
+    vga_end_update(vga);
+}
+
 void vga_write(Device* self, uint32_t addr, uint32_t value) {
     VGA* vga = self->state;
+    if (!vga->mem) return;
     switch (addr) {
-        case 0x0: {
+        case VGA_REG_ADDR: {
             vga->addr = value;
             break;
         }
-        case 0x1: {
+        case VGA_REG_DATA: {
+            if (vga->addr >= VGA_CELLS) break;
             vga->mem[vga->addr] = value;
-            vga_render(vga);
+            break;
+        }
+        case VGA_REG_START: {
+            vga_begin_update(vga);
+            atomic_store_explicit(&vga->start, value % VGA_CELLS, memory_order_relaxed);
+            vga_end_update(vga);
+            break;
+        }
+        case VGA_REG_SCROLL: {
+            vga_scroll(vga, (int32_t)value);
+            break;
+        }
+        case VGA_REG_RECT: {
+            vga->rect = value;
+            break;
+        }
+        case VGA_REG_FILL: {
+            vga_fill_rect(vga, value);
+            break;
+        }
+        case VGA_REG_CLEAR: {
+            vga_begin_update(vga);
+            vga_fill(vga->mem, value, VGA_CELLS);
+            atomic_store_explicit(&vga->start, 0, memory_order_relaxed);
+            vga_end_update(vga);
+            break;
+        }
+        case VGA_REG_MODE: {
+            if (value <= VGA_MODE_INDEXED) atomic_store_explicit(&vga->mode, value, memory_order_relaxed);
+            break;
+        }
+        case VGA_REG_PAL_INDEX: {
+            vga->pal_index = value & 0xFF;
+            break;
+        }
+        case VGA_REG_PAL_DATA: {
+            vga->palette[vga->pal_index] = value;
+            vga->pal_index = (vga->pal_index + 1) & 0xFF;
+            break;
         }
     }
 }
@@ -130,10 +635,22 @@ void vga_write(Device* self, uint32_t addr, uint32_t value) {
 VGA vga_state;
 
 Device vga_device = (Device){
-    .read = NULL,
+    .read = vga_read,
     .write = vga_write,
-    .base = 0xB8000,
-    .size = 0x1,
+    .base = VGA_BASE,
+    .size = VGA_REG_PAL_DATA,
     .state = &vga_state,
     .init = vga_init
+};
+
+Device vga_text_device = (Device){
+    .base = VGA_TEXT_BASE,
+    .size = VGA_CELLS - 1,
+    .mem = NULL, /* set by vga_init */
+};
+
+Device vga_fb_device = (Device){
+    .base = VGA_FB_BASE,
+    .size = VGA_FB_WORDS - 1,
+    .mem = NULL, /* set by vga_init */
 };
\ No newline at end of file
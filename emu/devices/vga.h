@@ -1,37 +1,102 @@
 #ifndef VGAC_H
 #define VGAC_H
 
+#ifdef HAVE_SDL
 #include <SDL2/SDL.h>
+#endif
+#include <pthread.h>
+#include <stdatomic.h>
 #include "machine.h"
 #include "../device.h"
 
 #define CHAR_W  9
 #define CHAR_H  16
-#define VGA_W    (80 * CHAR_W)
-#define VGA_H    (25 * CHAR_H)
+#define VGA_COLS 80
+#define VGA_ROWS 25
+#define VGA_CELLS (VGA_COLS * VGA_ROWS)
+#define VGA_W    (VGA_COLS * CHAR_W)
+#define VGA_H    (VGA_ROWS * CHAR_H)
+
+#define VGA_FG 0xFFFFFF00
+#define VGA_BG 0x00000000
+
+#define VGA_DIRTY_WORDS ((VGA_CELLS + 63) / 64)
 
 #define VGA_BASE 0xB8000
 
+/* Register offsets from VGA_BASE */
+#define VGA_REG_ADDR   0x0 /* cell index for VGA_REG_DATA */
+#define VGA_REG_DATA   0x1 /* write the cell at VGA_REG_ADDR */
+#define VGA_REG_STATUS 0x2 /* read: frames presented << 1 | vsync */
+#define VGA_REG_START  0x3 /* cell shown at the top left, for ring-buffer scrolling */
+#define VGA_REG_SCROLL 0x4 /* write: scroll up by N lines (down when negative) */
+#define VGA_REG_RECT   0x5 /* x | y << 8 | w << 16 | h << 24 for VGA_REG_FILL */
+#define VGA_REG_FILL   0x6 /* write: fill VGA_REG_RECT with the written cell */
+#define VGA_REG_CLEAR  0x7 /* write: fill the screen with the written cell */
+#define VGA_REG_MODE   0x8 /* one of VGA_MODE_* */
+#define VGA_REG_PAL_INDEX 0x9 /* palette entry VGA_REG_PAL_DATA writes next */
+#define VGA_REG_PAL_DATA  0xA /* write 0xRRGGBBxx to the entry, then advance */
+
+#define VGA_MODE_TEXT    0 /* 80x25 cells from the text buffer */
+#define VGA_MODE_RGB     1 /* VGA_W x VGA_H words of 0xRRGGBBxx from the framebuffer */
+#define VGA_MODE_INDEXED 2 /* palette indices, four pixels per word, low byte first */
+
+/* Linear framebuffer for the graphics modes, sized for VGA_MODE_RGB */
+#define VGA_FB_BASE  0x00C00000
+#define VGA_FB_WORDS (VGA_W * VGA_H)
+/* Linear text window: one word per cell, character in the top byte */
+#define VGA_TEXT_BASE (VGA_BASE + 0x100)
+
 typedef struct {
+#ifdef HAVE_SDL
     SDL_Window* window;
-    SDL_Surface* surface;
+    SDL_Surface* surface; /* drawn into; always 32 bits per pixel */
+    SDL_Surface* window_surface; /* the window's own, when surface is a shadow of it */
+    SDL_Rect rects[VGA_CELLS];
+    uint32_t* atlas; /* 256 glyphs pre-rendered in the surface's pixel format */
+#endif
     int width;
     int height;
-    uint32_t* mem;
+    uint32_t* mem;  /* live text buffer, written by the CPU thread */
+    uint32_t* snap; /* copy taken by the presenter for the current frame */
+    uint32_t* last; /* cells as of the last render */
+    atomic_uint seq; /* odd while a bulk update of mem is in progress */
+    atomic_uint start; /* cell of mem shown at the top left */
+    uint32_t rect;
+    uint32_t* fb;
+    atomic_uint mode;
+    uint32_t shown_mode; /* mode of the last presented frame */
+    uint32_t palette[256];
+    uint8_t pal_index;
+    uint64_t dirty[VGA_DIRTY_WORDS]; /* one bit per cell still to be drawn */
+    struct {
+        uint32_t cells_drawn; /* cells redrawn by the last frame */
+        uint64_t cells_total;
+        _Atomic uint64_t frames;
+    } stats;
+    atomic_bool vsync; /* a frame was presented since the guest last looked */
+    atomic_bool running;
+    pthread_t thread;
     uint16_t addr;
 } VGA;
 
+/* Set from the command line before the device is registered */
 typedef struct {
-    char c;
-    char* val;
-} Font;
+    int refresh_hz;           /* presenter frame rate */
+    bool headless;            /* keep the text buffer in memory only, no SDL */
+    bool ansi;                /* mirror changed cells to stdout */
+    const char* capture_path; /* screen capture at halt and on SIGUSR1 */
+    int capture_every;        /* also capture every N frames when > 0 */
+} VGAConfig;
 
 void vga_init(Device* self);
-void vga_render(VGA* vga);
 void vga_destroy(VGA* vga);
 
+extern VGAConfig vga_config;
 extern VGA vga_state;
 
 extern Device vga_device;
+extern Device vga_text_device;
+extern Device vga_fb_device;
 
 #endif
\ No newline at end of file
@@ -1,6 +1,9 @@
-#include "devices/vga.h"
-
-Font font[] = {
+/* Glyph source for vga_compile_font: CHAR_W x CHAR_H pixels per character,
+   '.' for background. Only vga.c includes it. */
+static const struct {
+    char c;
+    const char* val;
+} font[] = {
     {'\0',  "........."
             "........."
             "........."
@@ -11,7 +11,6 @@
 #define F_OVERFLOW      0b00000100
 #define F_NEGATIVE      0b00001000
 #define F_INT_ENABLED   0b00010000
-#define F_INT           0b00100000
 // #define F_
 // #define F_
 
@@ -19,6 +18,19 @@
 #define F_CLEAR(cpu, flag)  (cpu.flags &= ~flag)
 #define F_CHECK(cpu, flag)  (cpu.flags & flag)
 
+/* Interrupt return state, pushed as one word: pc in bits 23..0, flags in
+   bits 29..24 and mode in bits 31..30 */
+#define FRAME_PC_MASK 0x00FFFFFF
+#define FRAME_FLAGS_SHIFT 24
+#define FRAME_MODE_SHIFT 30
+
+/* R0..R7 are banked per interrupt level: entry switches to the next bank
+   and IRET switches back, so handlers need not save them. R8..R15 are
+   shared by all levels. Levels past the last bank spill R0..R7 to the
+   stack instead. */
+#define CPU_BANKS       4
+#define CPU_BANKED_REGS 8
+
 #define RAM_SIZE 0xFFFFFF
 #define ROM_SIZE 0xFFFF
 
@@ -27,6 +39,10 @@ typedef struct {
     uint32_t pc;
     uint32_t sp;
     uint32_t registers[16];
+    uint32_t banks[CPU_BANKS][CPU_BANKED_REGS]; /* R0..R7 of the banks not in use */
+    uint32_t level;                             /* interrupt nesting depth */
+    uint64_t idle_cycles;                       /* skipped in WFI to reach a scheduled event */
+    uint64_t idle_us;                           /* host time asleep in WFI */
     uint16_t interrupt;
     uint8_t flags;
     bool running;
@@ -1,19 +1,31 @@
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "machine.h"
 #include "debug.h"
 #include "ops.h"
 #include "ram.h"
+#include "sched.h"
 
 #include "devices/vga.h"
 #include "devices/keyboard.h"
 #include "devices/block.h"
+#include "devices/dma.h"
+#include "devices/vblk.h"
+#include "devices/console.h"
+#include "devices/pic.h"
+#include "devices/timer.h"
 
 Machine* global_machine;
+_Atomic int stop_signal;
+_Atomic bool cpu_kick;
 
 void (*ops[])(Machine* m, uint32_t op) = {
     [0x00] = NOP,
@@ -52,6 +64,14 @@ void (*ops[])(Machine* m, uint32_t op) = {
     [0x21] = CALL,
     [0x22] = RET,
     [0x23] = IRET,
+    [0x24] = MFB,
+    [0x25] = MTB,
+    [0x26] = STM,
+    [0x27] = LDM,
+    [0x28] = WFI,
+    [0x29] = MCPY,
+    [0x2A] = MSET,
+    [0x2B] = MCMP,
 };
 
 #define unlikely(cond)  __glibc_unlikely(cond)
@@ -60,38 +80,155 @@ void (*ops[])(Machine* m, uint32_t op) = {
 
 void step(Machine* m) {
     m->cpu.cycle++;
-    if (unlikely(F_CHECK(m->cpu, F_INT) && F_CHECK(m->cpu, F_INT_ENABLED))) {
-        uint32_t op = 0b01111100000000000000000000000000;
-        op |= m->cpu.interrupt << 2;
-        F_CLEAR(m->cpu, F_INT);
-        INT(m, op);
+    if (unlikely(m->cpu.cycle >= sched_deadline)) sched_run(m->cpu.cycle);
+    /* Lines stay pending at the PIC until they can be delivered */
+    uint32_t line;
+    if (unlikely(atomic_load_explicit(&irq_pending, memory_order_relaxed) & pic_state.enabled)
+        && F_CHECK(m->cpu, F_INT_ENABLED) && (line = pic_ack(&pic_state)) != PIC_NONE) {
+        m->cpu.interrupt = line;
+        interrupt_enter(m, pic_state.vectors[line]);
     } else {
         uint32_t op = fetch(m);
         uint8_t opcode = getbyte(op, 32) >> 2;
         if (ops[opcode]) { ops[opcode](m, op); return; }
+#ifdef DEBUG
         else { m->cpu.pc--; print_cpu_state(m, m);  printf("Illegal opcode 0x%02X\n", opcode); handle_signal(SIGABRT); }
+#else
+        else { fprintf(stderr, "Illegal opcode 0x%02X at 0x%08X\n", opcode, m->cpu.pc - 1); exit(1); }
+#endif
+    }
+}
+
+/* Returns the value of a "--name=value" argument, or NULL if arg is not it */
+static const char* opt_value(const char* arg, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') return NULL;
+    return arg + len + 1;
+}
+
+/* SIGINT and SIGTERM are blocked in every thread and taken here instead,
+   so the machine stops between instructions and main() closes the devices
+   on its way out. Later signals are taken and ignored: tools like timeout
+   send the same one to the process and again to its group. */
+static void* signal_loop(void* arg) {
+    const sigset_t* set = arg;
+    for (;;) {
+        int sig, none = 0;
+        if (sigwait(set, &sig) != 0) continue;
+        if (atomic_compare_exchange_strong(&stop_signal, &none, sig)) irq_kick();
     }
+    return NULL;
+}
+
+/* Must run before any other thread is created, so they all inherit the mask */
+static void signal_thread_start(void) {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signal_loop, &set) == 0) pthread_detach(thread);
 }
 
+/* Every way out, exit() on a fault included, comes through here so the
+   disk caches, overlay bitmaps and buffered output reach the host */
+static void devices_close(void) {
+    static bool closed;
+    if (closed) return;
+    closed = true;
+    vga_destroy(vga_device.state);
+    block_close(block_state);
+    block_state = NULL;
+    vblk_close(&vblk_state);
+    cons_close(&cons_state);
+    timer_close(&timer_state);
+}
+
+#ifdef DEBUG
+/* The keyboard's input thread reads the terminal and hands every byte to
+   debug_key first, so keys reach the guest, and the UI, even while the
+   CPU thread is parked in WFI. Space toggles step_mode at any time;
+   in step mode Enter advances one instruction. */
+static atomic_bool step_mode = true;
+static int debug_keys[2] = {-1, -1}; /* the keys debug_key took, for step_key */
+
+static bool debug_key(uint8_t c) {
+    bool stepping = atomic_load(&step_mode);
+    if (c == ' ') atomic_store(&step_mode, !stepping);
+    else if (!stepping || (c != '\r' && c != '\n')) return false;
+    ssize_t w = write(debug_keys[1], &c, 1);
+    (void)w;
+    irq_kick();
+    return true;
+}
+
+/* Next key for the step-mode prompt, or EOF once the machine is stopping */
+static int step_key(void) {
+    struct pollfd p = { .fd = debug_keys[0], .events = POLLIN };
+    while (!atomic_load_explicit(&stop_signal, memory_order_relaxed)) {
+        if (poll(&p, 1, 100) <= 0) continue;
+        unsigned char c;
+        return read(debug_keys[0], &c, 1) == 1 ? c : EOF;
+    }
+    return EOF;
+}
+#endif
 
 int main(int argc, char** argv) {
 #ifdef DEBUG
     puts("\n\n\n");
     debug_init();
 #endif
+
+    const char* args[2] = {0};
+    int nargs = 0;
+    for (int i = 1; i < argc; i++) {
+        const char* v;
+        if ((v = opt_value(argv[i], "--vga-hz"))) {
+            vga_config.refresh_hz = atoi(v);
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            vga_config.headless = true;
+        } else if (strcmp(argv[i], "--ansi") == 0) {
+            vga_config.ansi = true;
+        } else if ((v = opt_value(argv[i], "--capture"))) {
+            vga_config.capture_path = v;
+        } else if ((v = opt_value(argv[i], "--capture-every"))) {
+            vga_config.capture_every = atoi(v);
+        } else if ((v = opt_value(argv[i], "--kbd-buffer"))) {
+            kbd_config.buffer_size = (uint32_t)strtoul(v, NULL, 0);
+        } else if ((v = opt_value(argv[i], "--disk"))) {
+            block_config.path = v;
+        } else if ((v = opt_value(argv[i], "--vblk-disk"))) {
+            vblk_config.path = v;
+        } else if ((v = opt_value(argv[i], "--console-out"))) {
+            cons_config.out = v;
+        } else if ((v = opt_value(argv[i], "--console-in"))) {
+            cons_config.in = v;
+        } else if ((v = opt_value(argv[i], "--block-backend"))) {
+            block_config.mmap = strcmp(v, "stdio") != 0;
+        } else if ((v = opt_value(argv[i], "--block-cache"))) {
+            block_config.cache_sectors = (uint32_t)strtoul(v, NULL, 0);
+        } else if (nargs < 2) {
+            args[nargs++] = argv[i];
+        }
+    }
     
-    if (argc < 2) {
+    if (nargs < 1) {
         printf("Missing input file");
         return 1;
     }
     
-    FILE* src = fopen(argv[1], "rb");
+    signal_thread_start();
+
+    FILE* src = fopen(args[0], "rb");
     if (!src) {
         perror("fopen");
         return 1;
     }
     
     Machine m = {0};
+    global_machine = &m;
     ram_init();
     m.rom = malloc(sizeof(uint32_t) * ROM_SIZE);
     uint32_t program[1024];
@@ -103,12 +240,36 @@ int main(int argc, char** argv) {
         fclose(src);
     }
     
-    block_state = block_init("orion.img");
+#ifdef DEBUG
+    /* The keyboard reads the terminal; the step-mode UI takes its keys first */
+    if (pipe(debug_keys) == 0) kbd_config.stdin_hook = debug_key;
+#endif
+    /* Console input from stdin takes it over from the keyboard */
+    if (cons_config.in && strcmp(cons_config.in, "-") == 0) kbd_config.read_stdin = false;
+#ifdef DEBUG
+    /* Without the terminal the step-mode UI gets no keys, so just run */
+    if (!kbd_config.read_stdin || !kbd_config.stdin_hook) atomic_store(&step_mode, false);
+#endif
+
+    block_state = block_init(block_config.path);
+    if (!block_state) {
+        fprintf(stderr, "Cannot open disk image %s\n", block_config.path);
+        return 1;
+    }
     block_device.state = block_state;
+    atexit(devices_close);
 
     bus_register(&block_device);
     bus_register(&vga_device);
+    bus_register(&vga_text_device);
+    bus_register(&vga_fb_device);
     bus_register(&kbd_device);
+    bus_register(&dma_device);
+    bus_register(&vblk_device);
+    bus_register(&cons_device);
+    bus_register(&pic_device);
+    bus_register(&pic_vec_device);
+    bus_register(&timer_device);
 
     m.cpu.running = true;
     m.cpu.pc = 0x0;
@@ -116,7 +277,7 @@ int main(int argc, char** argv) {
     m.cpu.sp = RAM_SIZE;
     m.cpu.cycle = 0;
     F_SET(m.cpu, F_INT_ENABLED);
-    const char *bios_path = (argc >= 3) ? argv[2] : NULL;
+    const char *bios_path = args[1];
     if (bios_path) {
         FILE *b = fopen(bios_path, "rb");
         if (!b) {
@@ -138,64 +299,41 @@ int main(int argc, char** argv) {
     memcpy(&prev, &m, sizeof(Machine));
 
 #ifdef DEBUG
-    /* step_mode: when true, do not auto-step; only step on Enter.
-       Space toggles step_mode at any time. Start enabled. */
-    bool step_mode = true;
     tty_enable_raw();
     atexit(tty_restore);
-    global_machine = &m;
-    signal(SIGINT, handle_signal);   // Ctrl+C
-    signal(SIGTERM, handle_signal);  // kill
     signal(SIGABRT, handle_signal);  // abort
     signal(SIGSEGV, handle_signal);  // segmentation fault
 #endif
 
-    while (m.cpu.running) {
+    while (m.cpu.running && !atomic_load_explicit(&stop_signal, memory_order_relaxed)) {
 #ifdef DEBUG
 
-        if (step_mode) {
+        if (atomic_load_explicit(&step_mode, memory_order_relaxed)) {
             print_cpu_state(&m, &prev);
             printf(ANSI_DIM "Step-by-step mode ENABLED. Press Enter to advance, Space to toggle.\n" ANSI_RESET);
             fflush(stdout);
 
             for (;;) {
-                int c = getchar();
-                if (c == '\r' || c == '\n') {
-                    break;
-                } else if (c == ' ') {
-                    step_mode = false;
+                int c = step_key();
+                if (c == EOF || c == '\r' || c == '\n') break;
+                /* A Space that switched step mode on is still queued here */
+                if (!atomic_load(&step_mode)) {
                     print_cpu_state(&m, &prev);
                     printf(ANSI_DIM "Step-by-step mode DISABLED. Running...\n" ANSI_RESET);
                     fflush(stdout);
                     break;
-                } else {
-                    kbd_push(&kbd_device, c);
-                    m.cpu.interrupt = 1;
-                    F_SET(m.cpu, F_INT);
                 }
             }
 
+            atomic_store(&cpu_kick, false);
             step(&m);
             memcpy(&prev, &m, sizeof(Machine));
             continue;
         } else {
             step(&m);
+            /* WFI gave the thread back for a key; nothing else to do */
+            if (unlikely(atomic_load_explicit(&cpu_kick, memory_order_relaxed))) atomic_store(&cpu_kick, false);
             if (unlikely(m.cpu.cycle % CYCLE_TO_TRIGGER == 0)) {
-                if (stdin_has_data()) {
-                    int c = getchar();
-                    if (c == ' ') {
-                        step_mode = !step_mode;
-                        print_cpu_state(&m, &prev);
-                        printf(ANSI_DIM "Step-by-step mode %s. Press Enter to advance, Space to toggle.\n" ANSI_RESET,
-                            step_mode ? "ENABLED" : "DISABLED");
-                        fflush(stdout);
-                        while (stdin_has_data()) (void)getchar();
-                    } else {
-                        kbd_push(&kbd_device, c);
-                        m.cpu.interrupt = 1;
-                        F_SET(m.cpu, F_INT);
-                    }
-                }
                 print_cpu_state(&m, &prev);
                 memcpy(&prev, &m, sizeof(Machine));
             }
@@ -207,10 +345,18 @@ int main(int argc, char** argv) {
     }
 
     m.cpu.pc--;
+#ifdef DEBUG
     print_cpu_state(&m, &m);
     dump_machine_state(&m);
+#endif
 
+    devices_close();
     free(m.ram);
     free(m.rom);
+    int sig = atomic_load(&stop_signal);
+    if (sig) {
+        fprintf(stderr, "Received signal %d, exiting...\n", sig);
+        return 1;
+    }
     return 0;
 }
@@ -1,6 +1,11 @@
+#include <string.h>
+#include <time.h>
+
 #include "machine.h"
 #include "../asm/ops.h"
 #include "device.h"
+#include "sched.h"
+#include "devices/pic.h"
 
 #ifdef DEBUG
 #include <signal.h>
@@ -47,6 +52,43 @@ uint32_t pop(Machine* m) {
     return bus_read(++m->cpu.sp);
 }
 
+static void bank_switch(Machine* m, uint32_t from, uint32_t to) {
+    memcpy(m->cpu.banks[from], m->cpu.registers, sizeof(m->cpu.banks[from]));
+    memcpy(m->cpu.registers, m->cpu.banks[to], sizeof(m->cpu.banks[to]));
+}
+
+/* Interrupt entry: save pc, flags and mode in one stack word, move to the
+   next register bank and run the handler in kernel mode */
+void interrupt_enter(Machine* m, uint32_t handler) {
+    push(m, (m->cpu.pc & FRAME_PC_MASK) | (uint32_t)m->cpu.flags << FRAME_FLAGS_SHIFT |
+            (uint32_t)m->mode << FRAME_MODE_SHIFT);
+    if (m->cpu.level + 1 < CPU_BANKS) {
+        bank_switch(m, m->cpu.level, m->cpu.level + 1);
+    } else {
+        for (int i = 0; i < CPU_BANKED_REGS; i++) push(m, m->cpu.registers[i]);
+    }
+    m->cpu.level++;
+    m->mode = KERNEL;
+    m->cpu.pc = handler;
+}
+
+/* Bank operand of MFB/MTB as an interrupt level: absolute, or relative
+   to the current level when negative (#-1 is the interrupted code) */
+static uint32_t bank_level(Machine* m, int32_t imm) {
+    int64_t level = imm < 0 ? (int64_t)m->cpu.level + imm : imm;
+    return level < 0 ? 0 : (uint32_t)level;
+}
+
+/* R[reg] of level, or NULL when that level has no bank: its R0..R7 were
+   spilled to the stack on entry to the next level, or it is past the
+   last bank and not the current one */
+static uint32_t* bank_reg(Machine* m, uint32_t level, uint8_t reg) {
+    if (reg >= CPU_BANKED_REGS || level == m->cpu.level) return &m->cpu.registers[reg];
+    if (level < CPU_BANKS - 1 || (level == CPU_BANKS - 1 && m->cpu.level < level))
+        return &m->cpu.banks[level][reg];
+    return NULL;
+}
+
 OP(NOP) {
     (void)m; (void)op;
     return;
@@ -106,11 +148,11 @@ OP(RET) {
 OP(INT) {
     int32_t imm = sign_extend(getbits(op, 17, 2), 16);
     if (m->mode == BIOS) {
+        /* The BIOS hands over to the kernel entry point */
         m->mode = KERNEL;
         m->cpu.pc = imm;
     } else {
-        push(m, m->cpu.pc);
-        m->cpu.pc = bus_read(0x1234 + imm);
+        interrupt_enter(m, pic_vector(&pic_state, imm));
     }
 }
 
@@ -143,6 +185,35 @@ OP(PUSH) {
     }
 }
 
+/* STM Rb, #mask: the masked registers, lowest first, to consecutive words
+   from R[b]. One block copy when the range is plain RAM. */
+OP(STM) {
+    uint8_t base  = (uint8_t)getbits(op, 25, 22);
+    uint16_t mask = (uint16_t)getbits(op, 17, 2);
+    if (mask == 0xFFFF) {
+        bus_write_block(m->cpu.registers[base], m->cpu.registers, 16);
+        return;
+    }
+    uint32_t words[16];
+    size_t n = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (getbit(mask, i)) words[n++] = m->cpu.registers[i];
+    }
+    bus_write_block(m->cpu.registers[base], words, n);
+}
+
+/* LDM Rb, #mask: the inverse of STM */
+OP(LDM) {
+    uint8_t base  = (uint8_t)getbits(op, 25, 22);
+    uint16_t mask = (uint16_t)getbits(op, 17, 2);
+    uint32_t words[16];
+    bus_read_block(m->cpu.registers[base], words, __builtin_popcount(mask));
+    size_t n = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (getbit(mask, i)) m->cpu.registers[i] = words[n++];
+    }
+}
+
 OP(POP) {
     uint16_t mask = (uint16_t)getbits(op, 17, 2);
     for (int i = 15; i >= 0; --i) {
@@ -184,8 +255,154 @@ OP(OR) {
 
 OP(IRET) {
     (void)op;
-    m->mode = ~m->mode;
-    m->cpu.pc = pop(m);
+    if (m->cpu.level > 0) {
+        m->cpu.level--;
+        if (m->cpu.level + 1 < CPU_BANKS) {
+            bank_switch(m, m->cpu.level + 1, m->cpu.level);
+        } else {
+            for (int i = CPU_BANKED_REGS - 1; i >= 0; i--) m->cpu.registers[i] = pop(m);
+        }
+    }
+    uint32_t frame = pop(m);
+    m->cpu.pc = frame & FRAME_PC_MASK;
+    m->cpu.flags = (uint8_t)((frame >> FRAME_FLAGS_SHIFT) & 0x3F);
+    m->mode = frame >> FRAME_MODE_SHIFT;
+}
+
+/* WFI: park until a line that may interrupt is pending, then carry on
+   with the next instruction (taking the interrupt first if F_INT_ENABLED
+   is set). With a guest-cycle event due nothing else can happen before
+   it, so the cycles up to it are skipped rather than executed; with none
+   the host thread sleeps until some device thread raises a line. */
+OP(WFI) {
+    (void)op;
+    while (!(atomic_load_explicit(&irq_pending, memory_order_acquire) & pic_state.enabled)
+           && !atomic_load_explicit(&cpu_kick, memory_order_relaxed)) {
+        /* Skip straight to the next event that could end the wait. Events
+           that cannot raise an enabled line wait for the CPU to run again,
+           so one that keeps rescheduling itself does not spin here. */
+        uint64_t next = sched_next_irq(pic_state.enabled);
+        if (next != UINT64_MAX) {
+            if (next > m->cpu.cycle) {
+                m->cpu.idle_cycles += next - m->cpu.cycle;
+                m->cpu.cycle = next;
+            }
+            sched_run(m->cpu.cycle);
+            continue;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pic_wait(&pic_state);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        m->cpu.idle_us += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000 +
+                                     (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+}
+
+/* The bulk memory instructions move at most a page of words per step and
+   leave their registers describing what is left, re-executing until it
+   is done, so an interrupt is never held off for longer than one chunk
+   and returns into the unfinished instruction. */
+#define MEM_CHUNK WORDS_PER_PAGE
+
+static inline void mem_resume(Machine* m, uint32_t left) {
+    if (left) m->cpu.pc--;
+}
+
+/* MCPY Rd, Rs, Rn: copy R[n] words from R[s] to R[d] as memmove does */
+OP(MCPY) {
+    uint8_t rd = getbits(op, 25, 22), rs = getbits(op, 21, 18), rn = getbits(op, 17, 14);
+    uint32_t dst = m->cpu.registers[rd], src = m->cpu.registers[rs], len = m->cpu.registers[rn];
+    uint32_t k = len < MEM_CHUNK ? len : MEM_CHUNK;
+    /* A destination overlapping the end of the source is copied from the
+       back, so only the length moves */
+    bool backward = dst > src && dst - src < len;
+    uint32_t off = backward ? len - k : 0;
+    if (bus_range_is_ram(src + off, k) && bus_range_is_ram(dst + off, k)) {
+        ram_move(dst + off, src + off, k);
+    } else {
+        uint32_t buf[MEM_CHUNK];
+        bus_read_block(src + off, buf, k);
+        bus_write_block(dst + off, buf, k);
+    }
+    if (!backward) {
+        m->cpu.registers[rd] = dst + k;
+        m->cpu.registers[rs] = src + k;
+    }
+    m->cpu.registers[rn] = len - k;
+    mem_resume(m, len - k);
+}
+
+/* MSET Rd, Rv, Rn: store R[v] to R[n] words from R[d] */
+OP(MSET) {
+    uint8_t rd = getbits(op, 25, 22), rv = getbits(op, 21, 18), rn = getbits(op, 17, 14);
+    uint32_t dst = m->cpu.registers[rd], value = m->cpu.registers[rv], len = m->cpu.registers[rn];
+    uint32_t k = len < MEM_CHUNK ? len : MEM_CHUNK;
+    if (bus_range_is_ram(dst, k)) {
+        ram_fill(dst, value, k);
+    } else {
+        uint32_t buf[MEM_CHUNK];
+        for (uint32_t i = 0; i < k; i++) buf[i] = value;
+        bus_write_block(dst, buf, k);
+    }
+    m->cpu.registers[rd] = dst + k;
+    m->cpu.registers[rn] = len - k;
+    mem_resume(m, len - k);
+}
+
+/* MCMP Ra, Rb, Rn: compare R[n] words from R[a] and R[b]. Stops at the
+   first difference with R[a] and R[b] pointing at it, F_ZERO clear and
+   F_NEGATIVE set when the word at R[a] is the smaller; F_ZERO is set
+   when the ranges are equal. */
+OP(MCMP) {
+    uint8_t ra = getbits(op, 25, 22), rb = getbits(op, 21, 18), rn = getbits(op, 17, 14);
+    uint32_t a = m->cpu.registers[ra], b = m->cpu.registers[rb], len = m->cpu.registers[rn];
+    uint32_t k = len < MEM_CHUNK ? len : MEM_CHUNK;
+    uint32_t same, wa = 0, wb = 0;
+    if (bus_range_is_ram(a, k) && bus_range_is_ram(b, k)) {
+        same = (uint32_t)ram_compare(a, b, k);
+        if (same < k) {
+            wa = ram_read(a + same);
+            wb = ram_read(b + same);
+        }
+    } else {
+        uint32_t bufa[MEM_CHUNK], bufb[MEM_CHUNK];
+        bus_read_block(a, bufa, k);
+        bus_read_block(b, bufb, k);
+        for (same = 0; same < k && bufa[same] == bufb[same]; same++);
+        if (same < k) {
+            wa = bufa[same];
+            wb = bufb[same];
+        }
+    }
+    m->cpu.registers[ra] = a + same;
+    m->cpu.registers[rb] = b + same;
+    m->cpu.registers[rn] = len - same;
+    if (same < k) {
+        F_CLEAR(m->cpu, F_ZERO);
+        if ((int32_t)wa < (int32_t)wb) F_SET(m->cpu, F_NEGATIVE);
+        else F_CLEAR(m->cpu, F_NEGATIVE);
+        return;
+    }
+    F_SET(m->cpu, F_ZERO);
+    F_CLEAR(m->cpu, F_NEGATIVE);
+    mem_resume(m, len - k);
+}
+
+/* MFB Rd, Rs, #bank: Rd = Rs of another bank */
+OP(MFB) {
+    uint8_t dest = (uint8_t)getbits(op, 25, 22);
+    uint8_t src  = (uint8_t)getbits(op, 21, 18);
+    uint32_t* r = bank_reg(m, bank_level(m, sign_extend(getbits(op, 17, 2), 16)), src);
+    m->cpu.registers[dest] = r ? *r : 0;
+}
+
+/* MTB Rd, Rs, #bank: Rd of another bank = Rs */
+OP(MTB) {
+    uint8_t dest = (uint8_t)getbits(op, 25, 22);
+    uint8_t src  = (uint8_t)getbits(op, 21, 18);
+    uint32_t* r = bank_reg(m, bank_level(m, sign_extend(getbits(op, 17, 2), 16)), dest);
+    if (r) *r = m->cpu.registers[src];
 }
 
 OP(CMP) {
@@ -1,5 +1,6 @@
 #include "ram.h"
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include "machine.h"
 
@@ -64,3 +65,105 @@ uint32_t ram_read(uint32_t addr) {
     uint32_t offset = addr % WORDS_PER_PAGE;
     return p->data[offset];
 }
+
+
+/* Words from addr to the end of its page, capped at n */
+static inline size_t page_run(uint32_t addr, size_t n) {
+    size_t left = WORDS_PER_PAGE - addr % WORDS_PER_PAGE;
+    return left < n ? left : n;
+}
+
+void ram_read_block(uint32_t addr, void* dst, size_t n) {
+    uint8_t* out = dst;
+    while (n) {
+        size_t run = page_run(addr, n);
+        Page* p = get_page(addr, 0);
+        if (p) memcpy(out, &p->data[addr % WORDS_PER_PAGE], run * sizeof(uint32_t));
+        else memset(out, 0, run * sizeof(uint32_t));
+        out += run * sizeof(uint32_t);
+        addr += run;
+        n -= run;
+    }
+}
+
+void ram_write_block(uint32_t addr, const void* src, size_t n) {
+    const uint8_t* in = src;
+    while (n) {
+        size_t run = page_run(addr, n);
+        Page* p = get_page(addr, 1);
+        memcpy(&p->data[addr % WORDS_PER_PAGE], in, run * sizeof(uint32_t));
+        in += run * sizeof(uint32_t);
+        addr += run;
+        n -= run;
+    }
+}
+
+/* memmove for RAM: copies backwards when dst overlaps the end of src */
+void ram_move(uint32_t dst, uint32_t src, size_t n) {
+    if (dst == src || n == 0) return;
+    if (dst < src || dst >= src + n) {
+        while (n) {
+            size_t run = page_run(src, page_run(dst, n));
+            Page* s = get_page(src, 0);
+            Page* d = get_page(dst, 1);
+            if (s) memmove(&d->data[dst % WORDS_PER_PAGE], &s->data[src % WORDS_PER_PAGE], run * sizeof(uint32_t));
+            else memset(&d->data[dst % WORDS_PER_PAGE], 0, run * sizeof(uint32_t));
+            src += run;
+            dst += run;
+            n -= run;
+        }
+    } else {
+        uint32_t s_end = src + n, d_end = dst + n;
+        while (n) {
+            /* Largest run ending at both s_end and d_end within one page each */
+            size_t run = n;
+            size_t s_off = (s_end - 1) % WORDS_PER_PAGE + 1, d_off = (d_end - 1) % WORDS_PER_PAGE + 1;
+            if (s_off < run) run = s_off;
+            if (d_off < run) run = d_off;
+            s_end -= run;
+            d_end -= run;
+            Page* s = get_page(s_end, 0);
+            Page* d = get_page(d_end, 1);
+            if (s) memmove(&d->data[d_end % WORDS_PER_PAGE], &s->data[s_end % WORDS_PER_PAGE], run * sizeof(uint32_t));
+            else memset(&d->data[d_end % WORDS_PER_PAGE], 0, run * sizeof(uint32_t));
+            n -= run;
+        }
+    }
+}
+
+void ram_fill(uint32_t addr, uint32_t value, size_t n) {
+    /* memset when every byte of the word is the same */
+    bool bytes = value == (value & 0xFF) * 0x01010101u;
+    while (n) {
+        size_t run = page_run(addr, n);
+        Page* p = get_page(addr, value != 0);
+        if (p) {
+            uint32_t* w = &p->data[addr % WORDS_PER_PAGE];
+            if (bytes) memset(w, value & 0xFF, run * sizeof(uint32_t));
+            else for (size_t i = 0; i < run; i++) w[i] = value;
+        }
+        addr += run;
+        n -= run;
+    }
+}
+
+size_t ram_compare(uint32_t a, uint32_t b, size_t n) {
+    static const Page zero_page;
+    size_t done = 0;
+    while (done < n) {
+        size_t run = page_run(a, page_run(b, n - done));
+        const Page* pa = get_page(a, 0);
+        const Page* pb = get_page(b, 0);
+        const uint32_t* wa = &(pa ? pa : &zero_page)->data[a % WORDS_PER_PAGE];
+        const uint32_t* wb = &(pb ? pb : &zero_page)->data[b % WORDS_PER_PAGE];
+        if (wa != wb && memcmp(wa, wb, run * sizeof(uint32_t)) != 0) {
+            size_t i = 0;
+            while (wa[i] == wb[i]) i++;
+            return done + i;
+        }
+        a += run;
+        b += run;
+        done += run;
+    }
+    return n;
+}
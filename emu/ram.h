@@ -2,6 +2,7 @@
 #define RAM_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define PAGE_SIZE 4096
 #define WORDS_PER_PAGE (PAGE_SIZE / sizeof(uint32_t))
@@ -21,4 +22,13 @@ void ram_free(void);
 void ram_write(uint32_t addr, uint32_t value);
 uint32_t ram_read(uint32_t addr);
 
+/* Bulk access to n words starting at addr, a page-sized memcpy at a time.
+   They bypass the bus, so callers check bus_range_is_ram first. */
+void ram_read_block(uint32_t addr, void* dst, size_t n);
+void ram_write_block(uint32_t addr, const void* src, size_t n);
+void ram_move(uint32_t dst, uint32_t src, size_t n);
+void ram_fill(uint32_t addr, uint32_t value, size_t n);
+/* Leading words that are equal in both ranges, n when all of them are */
+size_t ram_compare(uint32_t a, uint32_t b, size_t n);
+
 #endif
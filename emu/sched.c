@@ -0,0 +1,65 @@
+#include "sched.h"
+
+typedef struct {
+    uint64_t cycle;
+    SchedFn fn;
+    void* arg;
+    uint32_t irqs; /* lines the event may raise */
+} SchedEvent;
+
+/* Unordered; there are only ever a handful of events in flight */
+static SchedEvent events[SCHED_MAX_EVENTS];
+static int num_events;
+
+uint64_t sched_deadline = UINT64_MAX;
+
+static void sched_update(void) {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < num_events; i++) {
+        if (events[i].cycle < next) next = events[i].cycle;
+    }
+    sched_deadline = next;
+}
+
+bool sched_at_irq(uint64_t cycle, SchedFn fn, void* arg, uint32_t irqs) {
+    if (num_events == SCHED_MAX_EVENTS) return false;
+    events[num_events++] = (SchedEvent){ .cycle = cycle, .fn = fn, .arg = arg, .irqs = irqs };
+    if (cycle < sched_deadline) sched_deadline = cycle;
+    return true;
+}
+
+bool sched_at(uint64_t cycle, SchedFn fn, void* arg) {
+    return sched_at_irq(cycle, fn, arg, 0);
+}
+
+uint64_t sched_next_irq(uint32_t lines) {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < num_events; i++) {
+        if ((events[i].irqs & lines) && events[i].cycle < next) next = events[i].cycle;
+    }
+    return next;
+}
+
+void sched_cancel(SchedFn fn, void* arg) {
+    for (int i = 0; i < num_events; i++) {
+        if (events[i].fn == fn && events[i].arg == arg) {
+            events[i--] = events[--num_events];
+        }
+    }
+    sched_update();
+}
+
+void sched_run(uint64_t now) {
+    /* Callbacks may schedule again, so take one due event at a time */
+    for (;;) {
+        int due = -1;
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].cycle <= now && (due < 0 || events[i].cycle < events[due].cycle)) due = i;
+        }
+        if (due < 0) break;
+        SchedEvent ev = events[due];
+        events[due] = events[--num_events];
+        ev.fn(ev.arg);
+    }
+    sched_update();
+}
@@ -0,0 +1,34 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Cycle-deadline events for devices that model latency. Everything here
+   runs on the CPU thread: step() calls sched_run once cpu.cycle reaches
+   sched_deadline. */
+
+#define SCHED_MAX_EVENTS 16
+
+typedef void (*SchedFn)(void* arg);
+
+/* Cycle of the earliest pending event, UINT64_MAX when there is none */
+extern uint64_t sched_deadline;
+
+/* Run fn(arg) once cpu.cycle reaches cycle; false when the queue is full */
+bool sched_at(uint64_t cycle, SchedFn fn, void* arg);
+
+/* sched_at for an event that may raise the interrupt lines in irqs (one
+   bit per line); WFI only skips ahead to events like these */
+bool sched_at_irq(uint64_t cycle, SchedFn fn, void* arg, uint32_t irqs);
+
+/* Cycle of the earliest event that may raise one of lines, or UINT64_MAX */
+uint64_t sched_next_irq(uint32_t lines);
+
+/* Drop a pending fn(arg), if any */
+void sched_cancel(SchedFn fn, void* arg);
+
+/* Run every event due at or before now */
+void sched_run(uint64_t now);
+
+#endif
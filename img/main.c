@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "devices/block_backend.h"
+#include "devices/block_overlay.h"
+#include "devices/block_compressed.h"
+
+/* Disk image tool: creates, inspects and merges block device images */
+
+static int usage(void) {
+    fprintf(stderr,
+            "usage: img create <overlay> <base>   new empty copy-on-write overlay on base\n"
+            "       img commit <overlay>          merge the overlay into its base and empty it\n"
+            "       img compress <image> <out>    copy any image into a new compressed image\n"
+            "       img decompress <image> <out>  copy any image into a new raw image\n"
+            "       img info <image>              show an image's format and size\n");
+    return 1;
+}
+
+static int cmd_info(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { perror(path); return 1; }
+    OverlayHeader h = {0};
+    size_t n = fread(&h, 1, sizeof(h), f);
+    fclose(f);
+    if (n == sizeof(h) && memcmp(h.magic, OVL_MAGIC, 8) == 0) {
+        h.base[sizeof(h.base) - 1] = 0;
+        printf("%s: overlay v%u on %s, %" PRIu64 " bytes\n", path, h.version, h.base, h.size);
+        return 0;
+    }
+    CmpHeader* ch = (CmpHeader*)&h;
+    if (n >= sizeof(*ch) && memcmp(ch->magic, CMP_MAGIC, 8) == 0) {
+        printf("%s: compressed v%u, %u-byte clusters, %" PRIu64 " bytes\n",
+               path, ch->version, ch->cluster_size, ch->size);
+        return 0;
+    }
+    BlockBackend* be = block_backend_open(path, false);
+    if (!be) { perror(path); return 1; }
+    printf("%s: raw, %" PRIu64 " bytes\n", path, be->size);
+    be->ops->close(be);
+    return 0;
+}
+
+/* Copy every byte of in into out, a cluster at a time */
+static int copy_image(BlockBackend* in, BlockBackend* out) {
+    uint8_t* buf = malloc(CMP_CLUSTER);
+    if (!buf) return -1;
+    int rc = 0;
+    for (uint64_t off = 0; rc == 0 && off < in->size; off += CMP_CLUSTER) {
+        size_t len = in->size - off < CMP_CLUSTER ? (size_t)(in->size - off) : CMP_CLUSTER;
+        rc = in->ops->read(in, off, buf, len);
+        if (rc == 0) rc = out->ops->write(out, off, buf, len);
+    }
+    if (rc == 0) rc = out->ops->flush(out);
+    free(buf);
+    return rc;
+}
+
+static int cmd_convert(const char* from, const char* to, bool compress) {
+    BlockBackend* in = block_backend_open(from, false);
+    if (!in) { perror(from); return 1; }
+    if (compress ? block_compressed_create(to) != 0 : access(to, F_OK) == 0) {
+        if (compress) perror(to);
+        else fprintf(stderr, "%s: already exists\n", to);
+        in->ops->close(in);
+        return 1;
+    }
+    BlockBackend* out = compress ? block_backend_compressed(to) : block_backend_stdio(to);
+    if (!out) { perror(to); in->ops->close(in); return 1; }
+    int rc = copy_image(in, out);
+    in->ops->close(in);
+    out->ops->close(out);
+    if (rc != 0) { perror(to); return 1; }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) return usage();
+    const char* cmd = argv[1];
+
+    if (strcmp(cmd, "create") == 0 && argc == 4) {
+        if (block_overlay_create(argv[2], argv[3]) != 0) { perror(argv[2]); return 1; }
+        return 0;
+    }
+    if (strcmp(cmd, "commit") == 0 && argc == 3) {
+        int64_t merged = block_overlay_commit(argv[2]);
+        if (merged < 0) { perror(argv[2]); return 1; }
+        printf("%" PRId64 " sectors merged\n", merged);
+        return 0;
+    }
+    if (strcmp(cmd, "compress") == 0 && argc == 4) return cmd_convert(argv[2], argv[3], true);
+    if (strcmp(cmd, "decompress") == 0 && argc == 4) return cmd_convert(argv[2], argv[3], false);
+    if (strcmp(cmd, "info") == 0 && argc == 3) return cmd_info(argv[2]);
+    return usage();
+}
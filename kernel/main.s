@@ -2,7 +2,9 @@ _start:
     call $main
     hlt
 main:
-    MOV   R15, #0
+    MOV   R15, #0x000B
+    SHL   R15, R15, #16
+    OR    R15, R15, #0x8100
 
     MOV   R0, #0
     MOV   R1, #0x00002000
@@ -16,46 +18,58 @@ main:
     ADD   R3, R3, #1
     STR   R2, R3, #0
 
+    MOV   R1, #0x00F9
+    SHL   R1, R1, #16
+    MOV   R0, #0x2710
+    STR   R0, R1, #1
+    MOV   R0, #0x000F
+    STR   R0, R1, #0
+
     CALL $idle
 
 TIMER_HANDLER:
-    PUSH  #0x000F
-
     MOV   R4, #0x00002000
     LDR   R5, R4, #0
     ADD   R5, R5, #1
     STR   R5, R4, #0
 
-    POP   #0x000F
     IRET
     HLT
 
 IRQ1_HANDLER:
-    PUSH  #0x000F
-    MOV   R1, #0x000B
-    SHL   R1, R1, #16
-    OR    R1, R1, #0x8000
-
-.loop:
     MOV   R2, #0x00FF
     SHL   R2, R2, #16
+
+.words:
+    LDR   R4, R2, #3
+    CMP   R4, #4
+    JL    $.bytes
+    LDR   R0, R2, #4
+    SHL   R1, R0, #24
+    STR   R1, R15, #0
+    SHL   R1, R0, #16
+    STR   R1, R15, #1
+    SHL   R1, R0, #8
+    STR   R1, R15, #2
+    STR   R0, R15, #3
+    ADD   R15, R15, #4
+    JMP   $.words
+
+.bytes:
     LDR   R0, R2, #0
     CMP   R0, #0
     JE    $.done
-
-    STR   R15, R1, #0
-    ADD   R15, R15, #1
     SHL   R0, R0, #24
-    ADD   R3, R1, #1
-    STR   R0, R3, #0
-    JMP   $.loop
+    STR   R0, R15, #0
+    ADD   R15, R15, #1
+    JMP   $.bytes
 
 .done:
-    POP   #0x000F
     IRET
     HLT
 
 idle:
+    WFI
     JMP   $idle
 
     mov r0, #0